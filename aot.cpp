@@ -0,0 +1,307 @@
+// Translates a program ahead of time into C++, for programs that are run
+// over and over with different data. Every instruction becomes a labelled
+// statement or two, branches become gotos and JR goes through a switch over
+// the code addresses. The C++ is built with aot_runtime.cpp and the simulator
+// library (see aot_runtime.h) into a program that takes a data file and
+// prints what the simulator would have.
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "dump.h"
+#include "isa.h"
+#include "machine.h"
+
+using namespace std;
+
+// the comparison each conditional branch makes with R0, from BEQ_HANDLER on
+const static char *BRANCH_COMPARISONS_STR[]{"==", "!=", "<", ">", "<=", ">="};
+
+/**
+ * append a printf style line to the translation
+ */
+static void emit(string &out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void emit(string &out, const char *format, ...) {
+  char line[256];
+  va_list arguments;
+
+  va_start(arguments, format);
+  vsnprintf(line, sizeof line, format, arguments);
+  va_end(arguments);
+  out += line;
+  out += '\n';
+}
+
+/**
+ * append a string literal, quoted and escaped
+ */
+static void emit_string(string &out, const char *text) {
+  out += '"';
+  for (const char *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') out += '\\';
+    out += *c;
+  }
+  out += '"';
+}
+
+/**
+ * append a taken branch to a fixed address
+ */
+template <class G>
+static void emit_jump(string &out, uint16_t target, int code_words) {
+  if (target >= G::CODE_WORDS) {
+    // off the end of the code area, the loop detector never sees it
+    emit(out, "    pc = 0x%04x;", target);
+    emit(out, "    goto illegal_opcode;");
+  } else if (target >= code_words) {
+    emit(out, "    AOT_JUMP(0x%04x, illegal_opcode);", target);
+  } else {
+    emit(out, "    AOT_JUMP(0x%04x, a%04x);", target, target);
+  }
+}
+
+/**
+ * translate the code area of a loaded machine
+ * @param code_filename what the code was loaded from, for the comments
+ * @param machine the name of the machine type the translation runs on
+ * @return the C++ source of a program
+ */
+template <class G>
+static string translate(const BasicMachine<G> &m, const char *code_filename,
+                        const char *machine) {
+  int code_words = G::CODE_WORDS;
+  string out;
+  string text;
+
+  // everything after the last word of the program is 0xFFFF and stops the
+  // processor, one label covers it
+  while (code_words > 0 && m.code[code_words - 1][0] == 0xFF &&
+         m.code[code_words - 1][1] == 0xFF) {
+    code_words--;
+  }
+
+  out += "// ";
+  out += code_filename;
+  out += "\n"
+         "// translated ahead of time by aot, build it with aot_runtime.cpp and\n"
+         "// the simulator library\n"
+         "#include <cstring>\n\n"
+         "#include \"aot_runtime.h\"\n\n";
+
+  emit(out, "static const uint8_t CODE[%d][WORD_SIZE] = {",
+       code_words > 0 ? code_words : 1);
+  for (int i = 0; i < code_words; i += 5) {
+    text = "   ";
+    for (int j = i; j < i + 5 && j < code_words; j++) {
+      char word[16];
+
+      snprintf(word, sizeof word, " {0x%02x, 0x%02x},", m.code[j][0],
+               m.code[j][1]);
+      text += word;
+    }
+    out += text + '\n';
+  }
+  out += "};\n\n";
+
+  emit(out, "static Phase run(%s &m) {", machine);
+  out += "  uint16_t r[REGISTERS];\n"
+         "  uint16_t pc = m.register_pc;\n"
+         "  uint16_t address;\n"
+         "  Phase result;\n"
+         "\n"
+         "  memcpy(r, m.registers_general, sizeof r);\n"
+         "  goto dispatch;\n";
+
+  for (int pc = 0; pc < code_words; pc++) {
+    const DecodeEntry &e = DECODE_TABLE_WORDS[m.code[pc]];
+    int l = e.left;
+    int right = e.right;
+    int literal = e.literal;
+
+    text.clear();
+    format_instruction(m.code[pc], text);
+    emit(out, "a%04x:  // %s", pc, text.c_str());
+    emit(out, "  AOT_COUNT(0x%04x);", pc);
+    switch (e.handler) {
+      case ADD_LITERAL_HANDLER:
+        emit(out, "  r[%d] += %d;", l, literal);
+        break;
+      case ADD_REGISTER_HANDLER:
+        emit(out, "  r[%d] += AOT_RIGHT_REGISTER(%d);", l, right);
+        break;
+      case SUB_LITERAL_HANDLER:
+        emit(out, "  r[%d] -= %d;", l, literal);
+        break;
+      case SUB_REGISTER_HANDLER:
+        emit(out, "  r[%d] -= AOT_RIGHT_REGISTER(%d);", l, right);
+        break;
+      case AND_LITERAL_HANDLER:
+        emit(out, "  r[%d] &= %d;", l, literal);
+        break;
+      case AND_REGISTER_HANDLER:
+        emit(out, "  r[%d] &= AOT_RIGHT_REGISTER(%d);", l, right);
+        break;
+      case OR_LITERAL_HANDLER:
+        emit(out, "  r[%d] |= %d;", l, literal);
+        break;
+      case OR_REGISTER_HANDLER:
+        emit(out, "  r[%d] |= AOT_RIGHT_REGISTER(%d);", l, right);
+        break;
+      case XOR_LITERAL_HANDLER:
+        emit(out, "  r[%d] ^= %d;", l, literal);
+        break;
+      case XOR_REGISTER_HANDLER:
+        emit(out, "  r[%d] ^= AOT_RIGHT_REGISTER(%d);", l, right);
+        break;
+      case MOVE_LITERAL_HANDLER:
+        emit(out, "  r[%d] = %d;", l, literal);
+        break;
+      case MOVE_LOAD_HANDLER:
+        emit(out, "  address = r[%d];", right);
+        emit(out, "  AOT_CHECK_ADDRESS(0x%04x);", pc);
+        emit(out, "  AOT_LOAD(%d);", l);
+        break;
+      case MOVE_STORE_LITERAL_HANDLER:
+        emit(out, "  address = r[%d];", l);
+        emit(out, "  AOT_CHECK_ADDRESS(0x%04x);", pc);
+        emit(out, "  AOT_STORE(%d);", literal);
+        break;
+      case MOVE_STORE_REGISTER_HANDLER:
+        emit(out, "  address = r[%d];", l);
+        emit(out, "  AOT_CHECK_ADDRESS(0x%04x);", pc);
+        emit(out, "  AOT_STORE(AOT_RIGHT_REGISTER(%d));", right);
+        break;
+      case SHIFT_RIGHT_HANDLER:
+        emit(out, "  r[%d] >>= 1;", l);
+        break;
+      case SHIFT_LEFT_HANDLER:
+        emit(out, "  r[%d] <<= 1;", l);
+        break;
+      case JR_HANDLER:
+        // like the engines, the PC is bumped after the jump
+        emit(out, "  pc = r[%d] - 1;", l);
+        emit(out, "  if (pc >= m.CODE_WORDS) goto illegal_opcode;");
+        emit(out, "  AOT_JUMP(pc, dispatch);");
+        break;
+      case BEQ_HANDLER:
+      case BNE_HANDLER:
+      case BLT_HANDLER:
+      case BGT_HANDLER:
+      case BLE_HANDLER:
+      case BGE_HANDLER:
+        emit(out, "  if (r[%d] %s r[0]) {", l,
+             BRANCH_COMPARISONS_STR[e.handler - BEQ_HANDLER]);
+        emit_jump<G>(out, pc + literal, code_words);
+        emit(out, "  }");
+        break;
+      default:
+        emit(out, "  pc = 0x%04x;", pc);
+        emit(out, "  goto illegal_opcode;");
+    }
+  }
+
+  // running off the end of the program, a 64K word code area wraps around
+  // like the PC does
+  if (code_words == MAX_AREA_SIZE) {
+    emit(out, "  goto a0000;");
+  } else {
+    emit(out, "  pc = 0x%04x;", code_words);
+    emit(out, "  goto illegal_opcode;");
+  }
+  out += "\n"
+         "dispatch:\n"
+         "  switch (pc) {\n";
+  for (int pc = 0; pc < code_words; pc++) {
+    emit(out, "    case 0x%04x: goto a%04x;", pc, pc);
+  }
+  out += "    default: goto illegal_opcode;\n"
+         "  }\n"
+         "illegal_opcode:\n"
+         "  result = ILLEGAL_OPCODE;\n"
+         "  goto stop;\n"
+         "infinite_loop:\n"
+         "  result = INFINITE_LOOP;\n"
+         "  goto stop;\n"
+         "illegal_address:\n"
+         "  result = ILLEGAL_ADDRESS;\n"
+         "stop:\n"
+         "  return aot_stop(m, r, pc, result);\n"
+         "}\n\n";
+
+  emit(out, "static const AotProgram<%s> PROGRAM = {", machine);
+  out += "    ";
+  emit_string(out, code_filename);
+  emit(out, ", CODE, %d, run};", code_words);
+  out += "\n"
+         "int main(int argc, const char *argv[]) {\n"
+         "  return aot_main(PROGRAM, argc, argv);\n"
+         "}\n";
+  return out;
+}
+
+/**
+ * load a program and write its translation
+ * @return the exit status
+ */
+template <class M>
+int translate_file(const char *code_filename, const char *output_filename,
+                   const char *machine) {
+  unique_ptr<M> m(new M);
+  string translation;
+  FILE *out;
+  bool rc;
+
+  if (!m->load_code(code_filename)) {
+    fprintf(stderr, "cannot load %s\n", code_filename);
+    if (m->load_error[0]) fprintf(stderr, "%s\n", m->load_error);
+    return 1;
+  }
+  translation = translate(*m, code_filename, machine);
+
+  out = fopen(output_filename, "wb");
+  if (!out) {
+    fprintf(stderr, "cannot write %s\n", output_filename);
+    return 1;
+  }
+  rc = write_all(fileno(out), translation.data(), translation.size());
+  rc = fclose(out) == 0 && rc;
+  if (!rc) {
+    fprintf(stderr, "cannot write %s\n", output_filename);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  const char *code_filename = NULL;
+  const char *output_filename = NULL;
+  bool large = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--large") == 0) {
+      large = true;
+    } else if (!code_filename) {
+      code_filename = argv[i];
+    } else if (!output_filename) {
+      output_filename = argv[i];
+    }
+  }
+  if (!code_filename || !output_filename) {
+    printf(
+        "usage: %s [--large] <code.o> <program.cpp>\n"
+        "       (a <code.asm> is assembled first; --large translates for 64K\n"
+        "        words of code and of data)\n",
+        argv[0]);
+    return 1;
+  }
+
+  if (large) {
+    return translate_file<LargeMachine>(code_filename, output_filename,
+                                        "LargeMachine");
+  }
+  return translate_file<Machine>(code_filename, output_filename, "Machine");
+}
@@ -0,0 +1,81 @@
+#include "aot_runtime.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "dump.h"
+
+using namespace std;
+
+// the names of the dump formats for --dump, in the order of DUMP_FORMATS
+const static char *DUMP_FORMATS_STR[]{"hex", "raw", "diff", "sparse"};
+
+// what the processor sees when the PC runs off the end of the code area
+static const uint8_t g_out_of_code_inst[WORD_SIZE] = {0xFF, 0xFF};
+
+template <class M>
+Phase aot_stop(M &m, const uint16_t *registers, uint16_t pc, Phase phase) {
+  memcpy(m.registers_general, registers, sizeof m.registers_general);
+  m.register_pc = pc;
+  m.current_inst_raw = pc < M::CODE_WORDS ? m.code[pc] : g_out_of_code_inst;
+  return phase;
+}
+
+template <class M>
+int aot_main(const AotProgram<M> &program, int argc, const char *argv[]) {
+  const char *data_filename = NULL;
+  DumpFormat dump = HEX_DUMP;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dump = NUM_DUMP_FORMATS;
+      for (int f = 0; f < NUM_DUMP_FORMATS; f++) {
+        if (strcmp(argv[i + 1], DUMP_FORMATS_STR[f]) == 0) {
+          dump = (DumpFormat)f;
+        }
+      }
+      i++;
+    } else if (!data_filename) {
+      data_filename = argv[i];
+    }
+  }
+  if (!data_filename || dump == NUM_DUMP_FORMATS) {
+    printf("usage: %s [--dump hex|raw|diff|sparse] <memory.dat>\n"
+           "       (%s translated ahead of time)\n",
+           argv[0], program.code_filename);
+    return 1;
+  }
+
+  unique_ptr<M> m(new M);
+  string output;
+  string errors;
+
+  // the code area as loading the code file would have left it
+  m->reset();
+  memcpy(m->code, program.code, program.code_words * WORD_SIZE);
+  if (!m->load_data(data_filename)) {
+    fprintf(stderr, "cannot load %s\n", data_filename);
+    if (m->load_error[0]) fprintf(stderr, "%s\n", m->load_error);
+    return 1;
+  }
+  m->reset_loop_detection();
+
+  Phase phase = program.run(*m);
+
+  // a raw dump is nothing but the data area, as in the simulator
+  m->report_stop(phase, dump == RAW_DUMP ? errors : output);
+  m->print_memory(output, dump);
+  fwrite(errors.data(), 1, errors.size(), stderr);
+  return write_all(1, output.data(), output.size()) ? 0 : 1;
+}
+
+template Phase aot_stop(Machine &m, const uint16_t *registers, uint16_t pc,
+                        Phase phase);
+template Phase aot_stop(LargeMachine &m, const uint16_t *registers,
+                        uint16_t pc, Phase phase);
+template int aot_main(const AotProgram<Machine> &program, int argc,
+                      const char *argv[]);
+template int aot_main(const AotProgram<LargeMachine> &program, int argc,
+                      const char *argv[]);
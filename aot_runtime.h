@@ -0,0 +1,109 @@
+// What a program translated ahead of time by aot (see aot.cpp) is linked
+// against. The translation is a C++ function over a machine's registers,
+// data area and loop counters with a label at every instruction address;
+// the runtime gives it a main that loads a data file the way the simulator
+// does, runs it and prints the stop reason and the data area just as the
+// simulator would have.
+//
+// The macros are what the translated code is written in. They expect the
+// function's locals to be called m (the machine), r (its registers), pc and
+// address, and the labels the stops go to.
+#ifndef AOT_RUNTIME_H_
+#define AOT_RUNTIME_H_
+
+#include <cstdint>
+
+#include "isa.h"
+#include "loop_detector.h"
+#include "machine.h"
+
+// a translated program
+template <class M>
+struct AotProgram {
+  const char *code_filename;         // what it was translated from
+  const uint8_t (*code)[WORD_SIZE];  // the code words, for stop reports
+  int code_words;                    // how many, the rest are 0xFFFF
+  Phase (*run)(M &m);                // the translation
+};
+
+// count the instruction at an address before running it, it is a loop once
+// it has run too often
+#define AOT_COUNT(at)                                            \
+  if (++m.loop_counts[at] > INFINITE_LOOP_TRIGGER_THRESHOLD) {   \
+    pc = (at);                                                   \
+    goto infinite_loop;                                          \
+  }
+
+// a taken branch to an address in the code area, the state at a branch
+// target is what the loop detector looks at
+#define AOT_JUMP(at, label)                                      \
+  pc = (at);                                                     \
+  if (loop_detector_check(m.loop_detector, pc, r, m.data))       \
+    goto infinite_loop;                                          \
+  goto label
+
+// the data address of the instruction at an address must be in range
+#define AOT_CHECK_ADDRESS(at)                                    \
+  if (address >= m.DATA_WORDS) {                                 \
+    pc = (at);                                                   \
+    goto illegal_address;                                        \
+  }
+
+// a load from the data area, address already checked. Words pass through
+// the same 6 bit sign extension as literals.
+#define AOT_LOAD(left) r[left] = aot_load(m.data, address)
+
+// a store to the data area, address already checked
+#define AOT_STORE(value) aot_store(m, address, (value))
+
+// register values pass through the same 6 bit sign extension as literals
+#define AOT_RIGHT_REGISTER(right) sign_extend(r[right], 6)
+
+template <class DataArea>
+inline uint16_t aot_load(const DataArea &data, uint16_t address) {
+  const uint8_t *loaded = data.word(address);
+
+  return sign_extend((loaded[0] << 8 & 0b111111110000000) | loaded[1], 6);
+}
+
+template <class M>
+inline void aot_store(M &m, uint16_t address, uint16_t word) {
+  uint8_t *stored = m.data.writable(address);
+
+  loop_detector_store(m.loop_detector, address, loop_detector_word(stored),
+                      word);
+  // big endian
+  stored[0] = word >> 8;
+  stored[1] = word & 0xFF;
+}
+
+/**
+ * hand the state of a stopped program back to the machine, so it can be
+ * reported like a run of any of the simulator's engines
+ * @param registers the translation's copy of the registers
+ * @param pc where it stopped
+ * @param phase why it stopped
+ * @return phase
+ */
+template <class M>
+Phase aot_stop(M &m, const uint16_t *registers, uint16_t pc, Phase phase);
+
+/**
+ * the main of a translated program: usage is
+ * "program [--dump hex|raw|diff|sparse] <memory.dat>"
+ * @return the exit status
+ */
+template <class M>
+int aot_main(const AotProgram<M> &program, int argc, const char *argv[]);
+
+// both are built in aot_runtime.cpp
+extern template Phase aot_stop(Machine &m, const uint16_t *registers,
+                               uint16_t pc, Phase phase);
+extern template Phase aot_stop(LargeMachine &m, const uint16_t *registers,
+                               uint16_t pc, Phase phase);
+extern template int aot_main(const AotProgram<Machine> &program, int argc,
+                             const char *argv[]);
+extern template int aot_main(const AotProgram<LargeMachine> &program,
+                             int argc, const char *argv[]);
+
+#endif  // AOT_RUNTIME_H_
@@ -0,0 +1,760 @@
+// The assembler proper, see assemble.h. Each line is "[label:] OPERATION
+// operand[,operand]"; the words are read straight out of the source, labels
+// go into a hashed symbol table and branches are patched as their labels turn
+// up, so a source is assembled in one pass.
+#include "assemble.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "isa.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+// how much label text one arena block holds
+#define ARENA_BLOCK_SIZE  4096
+// the widest branch offset we can encode, in words either way
+#define BRANCH_MIN        -32
+#define BRANCH_MAX        31
+
+
+// a piece of the source text, pointing straight into it
+struct TOKEN
+{
+  const char    *text;
+  int            length;    // 0 if the token isn't there
+};
+
+typedef struct TOKEN Token;
+
+
+// Label text is copied into big blocks once and never moved, so everything
+// else can just point at it.
+struct SYMBOL_ARENA
+{
+  vector<char*>  blocks;
+  int            used;      // bytes taken from the last block
+};
+
+typedef struct SYMBOL_ARENA SymbolArena;
+
+// a label, defined or only branched to so far
+struct SYMBOL
+{
+  const char    *name;      // interned, NUL terminated
+  int            length;
+  unsigned int   hash;
+  int            address;   // word address, or -1 until defined
+  int            line;      // source line of the definition or first branch
+  int            pending;   // first branch waiting for the address, or -1
+};
+
+typedef struct SYMBOL Symbol;
+
+// a branch to a label we haven't seen yet, patched once we do
+struct BACKPATCH
+{
+  int            address;   // word address of the branch
+  int            line;
+  int            next;      // the next branch to the same label, or -1
+};
+
+typedef struct BACKPATCH Backpatch;
+
+// The labels in the order they're first seen, with an open addressing hash
+// table of indexes into them so each branch and label is one lookup.
+struct SYMBOL_TABLE
+{
+  vector<Symbol>     symbols;
+  vector<int>        slots;     // -1 when empty, size is a power of 2
+  vector<int>        defined;   // the symbols in the order they're defined
+  vector<Backpatch>  patches;
+  SymbolArena        arena;
+};
+
+typedef struct SYMBOL_TABLE SymbolTable;
+
+
+// copies length bytes of text into the arena, returning the copy
+static const char *intern( SymbolArena &arena, const char *text, int length )
+{
+  char *copy;
+  
+  // start a new block when this one is full, a big one for a huge label
+  if ( arena.blocks.empty() || arena.used + length + 1 > ARENA_BLOCK_SIZE )
+  {
+    arena.blocks.push_back(
+      new char[length + 1 > ARENA_BLOCK_SIZE ? length + 1 : ARENA_BLOCK_SIZE] );
+    arena.used = 0;
+  }
+  
+  copy = arena.blocks.back() + arena.used;
+  memcpy( copy, text, length );
+  copy[length] = '\0';
+  arena.used += length + 1;
+  
+  return copy;
+}
+
+
+// gives back everything the symbol table allocated
+static void free_symbols( SymbolTable &table )
+{
+  int i;
+  
+  for ( i=0 ; i<(int)table.arena.blocks.size() ; i++ )
+    delete[] table.arena.blocks[i];
+  table.arena.blocks.clear();
+}
+
+
+// FNV-1a over the label text
+static unsigned int hash_label( const char *text, int length )
+{
+  unsigned int hash = 2166136261u;
+  int i;
+  
+  for ( i=0 ; i<length ; i++ )
+  {
+    hash ^= (unsigned char)text[i];
+    hash *= 16777619u;
+  }
+  
+  return hash;
+}
+
+
+// puts a symbol in the first free slot after its hash
+static void insert_slot( SymbolTable &table, int index )
+{
+  unsigned int mask = table.slots.size() - 1;
+  unsigned int slot = table.symbols[index].hash & mask;
+  
+  while ( table.slots[slot] >= 0 )
+    slot = (slot + 1) & mask;
+  table.slots[slot] = index;
+}
+
+
+// Finds the label with the given text, adding it as undefined if it's new.
+// Returns its index in table.symbols.
+static int find_symbol( SymbolTable &table, const char *text, int length,
+                        int line )
+{
+  unsigned int hash = hash_label( text, length );
+  unsigned int mask;
+  unsigned int slot;
+  int index;
+  Symbol symbol;
+  
+  // keep the table at most half full, doubling it from 64 slots
+  if ( table.slots.size() < 2 * (table.symbols.size() + 1) )
+  {
+    table.slots.assign( table.slots.empty() ? 64 : 2 * table.slots.size(),
+                        -1 );
+    for ( index=0 ; index<(int)table.symbols.size() ; index++ )
+      insert_slot( table, index );
+  }
+  
+  mask = table.slots.size() - 1;
+  for ( slot=hash & mask ; table.slots[slot] >= 0 ; slot=(slot + 1) & mask )
+  {
+    const Symbol &found = table.symbols[table.slots[slot]];
+    
+    if ( found.hash == hash && found.length == length &&
+         memcmp( found.name, text, length ) == 0 )
+      return table.slots[slot];
+  }
+  
+  symbol.name = intern( table.arena, text, length );
+  symbol.length = length;
+  symbol.hash = hash;
+  symbol.address = -1;
+  symbol.line = line;
+  symbol.pending = -1;
+  
+  index = table.symbols.size();
+  table.symbols.push_back( symbol );
+  table.slots[slot] = index;
+  
+  return index;
+}
+
+
+
+// the first character of a token, or NUL if it's empty
+static inline char first_char( Token token )
+{
+  return token.length > 0 ? token.text[0] : '\0';
+}
+
+
+// spaces and tabs and the like, what sscanf's %s stops at, except newlines
+static inline bool is_blank( char c )
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+// Reads the whitespace separated words of the line at cursor into fields,
+// up to max of them, and moves cursor on to the next line. Returns how many
+// there were.
+static int read_fields( const char *&cursor, const char *end, Token *fields,
+                        int max )
+{
+  const char *c = cursor;
+  const char *start;
+  int count = 0;
+  
+  while ( c < end && *c != '\n' )
+  {
+    if ( is_blank( *c ) )
+    {
+      c++;
+      continue;
+    }
+    
+    start = c;
+    while ( c < end && *c != '\n' && !is_blank( *c ) )
+      c++;
+    
+    if ( count < max )
+    {
+      fields[count].text = start;
+      fields[count].length = c - start;
+      count++;
+    }
+  }
+  
+  cursor = c < end ? c + 1 : end;
+  
+  return count;
+}
+
+
+// Takes the next comma separated operand from c, skipping empty ones like
+// strtok does. The token is empty when there are no more.
+static Token next_operand( const char *&c, const char *end )
+{
+  Token operand;
+  
+  while ( c < end && *c == ',' )
+    c++;
+  
+  operand.text = c;
+  while ( c < end && *c != ',' )
+    c++;
+  operand.length = c - operand.text;
+  
+  return operand;
+}
+
+
+// appends a line to the error messages, printf style
+static void add_error( string &errors, const char *format, ... )
+{
+  char message[256];
+  va_list arguments;
+  
+  va_start( arguments, format );
+  vsnprintf( message, sizeof message, format, arguments );
+  va_end( arguments );
+  
+  errors += message;
+  errors += '\n';
+}
+
+
+// packs up to 4 characters of a mnemonic into a number to switch on, 0 if
+// it's longer (stops early at a NUL, so it works on literals as well)
+static constexpr unsigned int pack_mnemonic( const char *text, int length )
+{
+  unsigned int packed = 0;
+  
+  if ( length > 4 )
+    return 0;
+  for ( int i=0 ; i<length && text[i] ; i++ )
+    packed = packed << 8 | (unsigned char)text[i];
+  
+  return packed;
+}
+
+#define MNEMONIC( text )  pack_mnemonic( text, 4 )
+
+
+// Finds the first 3 bits of the opcode corresponding to the given operation,
+// and the next 3 for the shifts and branches, which the operation picks.
+// Returns false if it isn't an operation we know.
+static bool get_opcode( Token operation, unsigned char &opcode,
+                        unsigned char &type )
+{
+  type = 0x00;
+  
+  switch ( pack_mnemonic( operation.text, operation.length ) )
+  {
+    case MNEMONIC( "ADD" ):   opcode = ADD_OPCODE;     break;
+    case MNEMONIC( "SUB" ):   opcode = SUB_OPCODE;     break;
+    case MNEMONIC( "AND" ):   opcode = AND_OPCODE;     break;
+    case MNEMONIC( "OR" ):    opcode = OR_OPCODE;      break;
+    case MNEMONIC( "XOR" ):   opcode = XOR_OPCODE;     break;
+    case MNEMONIC( "MOVE" ):  opcode = MOVE_OPCODE;    break;
+    
+    // indicate left or right shifting
+    case MNEMONIC( "SRL" ):   opcode = SHIFT_OPCODE;   type = 0x01; break;
+    case MNEMONIC( "SRR" ):   opcode = SHIFT_OPCODE;   break;
+    
+    // identify the branch based on the instruction
+    case MNEMONIC( "JR" ):    opcode = BRANCH_OPCODE;  break;
+    case MNEMONIC( "BEQ" ):   opcode = BRANCH_OPCODE;  type = 0x01; break;
+    case MNEMONIC( "BNE" ):   opcode = BRANCH_OPCODE;  type = 0x02; break;
+    case MNEMONIC( "BLT" ):   opcode = BRANCH_OPCODE;  type = 0x03; break;
+    case MNEMONIC( "BGT" ):   opcode = BRANCH_OPCODE;  type = 0x04; break;
+    case MNEMONIC( "BLE" ):   opcode = BRANCH_OPCODE;  type = 0x05; break;
+    case MNEMONIC( "BGE" ):   opcode = BRANCH_OPCODE;  type = 0x06; break;
+    
+    default:
+      opcode = ADD_OPCODE;
+      return false;
+  }
+  
+  return true;
+}  
+
+
+// returns the type specifier for the given opcode and it's operands
+// specifies the specific addressing mode, the operation sub-type from
+// get_opcode() is passed in
+static unsigned char get_opcode_type( unsigned char opcode,
+                                      unsigned char type,
+                                      Token operand1, Token operand2 )
+{
+  // arithmetic if on or before the XOR opcode
+  if ( opcode <= XOR_OPCODE )
+  {
+    // need to indicate if the 2nd operand is a register
+    if ( first_char( operand2 ) == 'R' )
+      type = 0x01;
+  }
+  
+  else if ( opcode == MOVE_OPCODE )
+  {
+    // need to specify addressing mode
+    
+    // handle destination being a memory locatoin
+    if ( first_char( operand1 ) == '[' )
+    {
+      type = 0x04;
+      
+      // a register for a source is fine
+      if ( first_char( operand2 ) == 'R' )
+        type |= 0x01;
+      
+      // but another memory location isn't
+      else if ( first_char( operand2 ) == '[' )
+        type |= 0x02;
+    }
+    
+    // it's a register
+    else if ( first_char( operand1 ) == 'R' )
+    {
+      // memory for a source is fine
+      if ( first_char( operand2 ) == '[' )
+        type |= 0x01;
+      
+      // but another register isn't
+      else if ( first_char( operand2 ) == 'R' )
+        type |= 0x02;
+    }
+    
+    // it must be a literal, which isn't allowed
+    else
+    {
+      type |= 0x02;
+    }
+  }
+  
+  return type;
+}
+
+
+// reads a decimal number with an optional sign from the front of text,
+// stopping at the first character that isn't a digit
+static int parse_number( const char *text, int length )
+{
+  bool negative = false;
+  int value = 0;
+  int i = 0;
+  
+  if ( length > 0 && (text[0] == '-' || text[0] == '+') )
+  {
+    negative = text[0] == '-';
+    i++;
+  }
+  for ( ; i<length && text[i] >= '0' && text[i] <= '9' ; i++ )
+    value = value * 10 + (text[i] - '0');
+  
+  return negative ? -value : value;
+}
+
+
+// extracts the register value from an operand, R<n> or [R<n>]
+static unsigned char get_register( Token operand )
+{
+  int skip = first_char( operand ) == '[' ? 2 : 1;
+  
+  if ( operand.length <= skip )
+    return 0;
+  
+  return (unsigned char)parse_number( operand.text + skip,
+                                      operand.length - skip );
+}
+
+
+// Compares the operands of an instruction, as decoded from the word we made
+// for it, with the ones on its line. Registers past R15 and literals that
+// don't fit in 6 bits lose bits on the way in. Returns false if any did.
+static bool check_encoding( const DecodeEntry &encoded, Token operand1,
+                            Token operand2, const char *filename, int line,
+                            string &errors )
+{
+  bool fits = true;
+  int literal;
+  
+  if ( (first_char( operand1 ) == 'R' || first_char( operand1 ) == '[') &&
+       encoded.left != get_register( operand1 ) )
+  {
+    add_error( errors, "%s:%d: %.*s is not a register", filename, line,
+               operand1.length, operand1.text );
+    fits = false;
+  }
+  
+  if ( first_char( operand2 ) == 'R' || first_char( operand2 ) == '[' )
+  {
+    if ( encoded.right != get_register( operand2 ) )
+    {
+      add_error( errors, "%s:%d: %.*s is not a register", filename, line,
+                 operand2.length, operand2.text );
+      fits = false;
+    }
+  }
+  
+  // branch offsets are checked when they're patched in
+  else if ( operand2.length > 0 && encoded.opcode != BRANCH_OPCODE )
+  {
+    // either signed or unsigned 6 bits will do
+    literal = parse_number( operand2.text, operand2.length );
+    if ( literal != encoded.literal && literal != encoded.literal + 64 )
+    {
+      add_error( errors, "%s:%d: %d doesn't fit in 6 bits", filename, line,
+                 literal );
+      fits = false;
+    }
+  }
+  
+  return fits;
+}
+
+
+// Puts the offset from the branch at one word address to a label at another
+// into the last 6 bits of the branch. Returns false if it doesn't fit.
+static bool patch_branch( unsigned char *machine_code, int branch, int label,
+                          const char *filename, int line, const char *name,
+                          string &errors )
+{
+  // this subtraction makes labels prior to the branch have a
+  // negative offset...
+  // it also assumes the PC is incremented after the instruction is
+  // executed, otherwise you'd have to add/subtract 1
+  int offset = label - branch;
+  
+  if ( offset < BRANCH_MIN || offset > BRANCH_MAX )
+  {
+    add_error( errors, "%s:%d: %s is %d words away, too far to branch to",
+               filename, line, name, offset );
+    return false;
+  }
+  
+  // clear off the first 2 bits of the offset and put it in
+  machine_code[branch*WORD_SIZE + 1] |= offset & 0x3F;
+  
+  return true;
+}
+
+
+// Takes each source line and converts it to the equivalent machine code,
+// reading the words straight out of the source with no copies.
+// A branch to a label we've already seen gets its offset straight away, one
+// to a label further on waits in the label's backpatch list until we get
+// there. Returns the number of bytes of actual machine code, with the labels
+// in table, or -1 if there were mistakes (described in errors).
+static int generate_machine_code( unsigned char *machine_code, int capacity,
+                                  const char *source, size_t size,
+                                  SymbolTable &table, const char *filename,
+                                  string &errors )
+{
+  int length = 0;
+  int line = 0;
+  const char *cursor = source;
+  const char *end = source + size;
+  const char *c;
+  // a label, the operation and its operands
+  Token fields[3];
+  int count;
+  Token label;
+  Token operation;
+  Token operands;
+  Token operand1;
+  Token operand2;
+  bool labelled = false;
+  bool branch_to_label = false;
+  // note that this could be done with a union or bit field over a short
+  unsigned char instr_high;
+  unsigned char instr_low;
+  unsigned char opcode;
+  unsigned char type;
+  int address;
+  int index;
+  int patch;
+  int mistakes = 0;
+  
+  while ( cursor < end && length+WORD_SIZE<=capacity )
+  {
+    line++;
+    count = read_fields( cursor, end, fields, 3 );
+    
+    // don't process if we couldn't get a valid line
+    if ( count == 0 )
+      continue;
+    
+    // three words means a labelled statement
+    labelled = count == 3;
+    label = fields[0];
+    operation = fields[labelled ? 1 : 0];
+    if ( count >= 2 )
+      operands = fields[labelled ? 2 : 1];
+    else
+    {
+      operands.text = operation.text + operation.length;
+      operands.length = 0;
+    }
+    branch_to_label = false;
+    
+    // split off the operands
+    c = operands.text;
+    operand1 = next_operand( c, operands.text + operands.length );
+    operand2 = next_operand( c, operands.text + operands.length );
+    
+    // start with the first 3 bits of the opcode
+    if ( !get_opcode( operation, opcode, type ) )
+    {
+      add_error( errors, "%s:%d: unknown operation %.*s", filename, line,
+                 operation.length, operation.text );
+      mistakes++;
+    }
+    instr_high = opcode;
+    
+    // determine the next 3 bits based on our current opcode
+    instr_high <<= 3;
+    instr_high |= get_opcode_type( opcode, type, operand1, operand2 );
+    
+    // put in the operand 1 code -- always a register value
+    instr_high <<= 2;
+    instr_high |= (get_register( operand1 ) >> 2);
+    instr_low = get_register( operand1 ) & 0x03;
+    
+    // only process operand 2 if it's present
+    if ( operand2.length > 0 )
+    {
+      // put in the operand 2 code -- not always a register...
+      if ( operand2.text[0] == 'R' || operand2.text[0] == '[' )
+      {
+        instr_low <<= 4;
+        instr_low |= get_register( operand2 );
+        
+        // pad the last 2 bits
+        instr_low <<= 2;
+      }
+      
+      // must be a literal (unless a branch...)
+      else
+      {
+        // for an opcode, we'll put and address in later
+        if ( opcode == BRANCH_OPCODE )
+        {
+          branch_to_label = true;
+          
+          // make space for adding the address
+          instr_low <<= 6;
+        }
+        
+        // definitely a literal
+        else
+        {
+          unsigned char literal =
+            (unsigned char)parse_number( operand2.text, operand2.length );
+          
+          // mask out the top 2 bits (only want numbers we can handle)
+          // note that for negatives we would have to sign extend when
+          // extracting in order to get the correct value
+          literal &= 0x3F;
+          
+          instr_low <<= 6;
+          instr_low |= literal;
+        }
+      }
+    }
+    
+    // no operand 2, shift the instruction to fill the unused bits
+    else
+      instr_low <<= 6;
+    
+    // put the instruction into our code space
+    address = length / WORD_SIZE;
+    machine_code[length++] = instr_high;
+    machine_code[length++] = instr_low;
+    
+    // decode the word again to see it says what the line does, the bits
+    // above are packed without checking anything fits (a legal line can
+    // still make an illegal instruction, the simulator stops on those)
+    if ( !check_encoding( DECODE_TABLE_WORDS[machine_code + address*WORD_SIZE],
+                          operand1, operand2, filename, line, errors ) )
+      mistakes++;
+    
+    // branch now if we know where to, otherwise wait for the label
+    if ( branch_to_label )
+    {
+      index = find_symbol( table, operand2.text, operand2.length, line );
+      Symbol &target = table.symbols[index];
+      
+      if ( target.address >= 0 )
+      {
+        if ( !patch_branch( machine_code, address, target.address,
+                            filename, line, target.name,
+                            errors ) )
+          mistakes++;
+      }
+      else
+      {
+        Backpatch waiting = { address, line, target.pending };
+        
+        target.pending = table.patches.size();
+        table.patches.push_back( waiting );
+      }
+    }
+    
+    // define the label, and fix every branch that was waiting for it
+    if ( labelled )
+    {
+      // get rid of the ":"
+      index = find_symbol( table, label.text, label.length - 1, line );
+      Symbol &symbol = table.symbols[index];
+      
+      if ( symbol.address >= 0 )
+      {
+        add_error( errors, "%s:%d: %s is already defined on line %d",
+                   filename, line, symbol.name, symbol.line );
+        mistakes++;
+      }
+      else
+      {
+        symbol.address = address;
+        symbol.line = line;
+        table.defined.push_back( index );
+        
+        for ( patch=symbol.pending ; patch>=0 ;
+              patch=table.patches[patch].next )
+        {
+          if ( !patch_branch( machine_code, table.patches[patch].address,
+                              address, filename,
+                              table.patches[patch].line, symbol.name,
+                              errors ) )
+            mistakes++;
+        }
+        symbol.pending = -1;
+      }
+    }
+  }
+  
+  // anything still waiting branches to a label that doesn't exist
+  for ( index=0 ; index<(int)table.symbols.size() ; index++ )
+  {
+    for ( patch=table.symbols[index].pending ; patch>=0 ;
+          patch=table.patches[patch].next )
+    {
+      add_error( errors, "%s:%d: %s is never defined", filename,
+                 table.patches[patch].line, table.symbols[index].name );
+      mistakes++;
+    }
+  }
+  
+  return mistakes ? -1 : length;
+}
+
+
+int assemble( const char *source, size_t size, uint8_t *code, int capacity,
+              const char *filename, vector<AssemblyLabel> &labels,
+              string &errors )
+{
+  SymbolTable table;
+  int length;
+  int i;
+  
+  length = generate_machine_code( code, capacity, source, size, table,
+                                  filename, errors );
+  
+  // hand the labels back in strings of their own, the arena goes
+  labels.clear();
+  for ( i=0 ; i<(int)table.defined.size() ; i++ )
+  {
+    const Symbol &symbol = table.symbols[table.defined[i]];
+    AssemblyLabel label;
+    
+    label.address = symbol.address;
+    label.name.assign( symbol.name, symbol.length );
+    labels.push_back( label );
+  }
+  free_symbols( table );
+  
+  return length;
+}
+
+
+int assemble_file( const char *filename, uint8_t *code, int capacity,
+                   vector<AssemblyLabel> &labels, string &errors )
+{
+  vector<char> input;
+  char block[4096];
+  size_t got;
+  
+  // standard input can't be mapped, read it all first
+  if ( strcmp( filename, "-" ) == 0 )
+  {
+    while ( (got = fread( block, 1, sizeof block, stdin )) > 0 )
+      input.insert( input.end(), block, block + got );
+    
+    return assemble( input.data(), input.size(), code, capacity, "<stdin>",
+                     labels, errors );
+  }
+  
+  MappedFile source_file( filename );
+  
+  if ( !source_file.is_open() )
+  {
+    add_error( errors, "cannot read %s", filename );
+    return -1;
+  }
+  
+  return assemble( (const char *)source_file.bytes(), source_file.size(),
+                   code, capacity, filename, labels, errors );
+}
+
+
+bool is_assembly_source( const char *filename )
+{
+  size_t length = strlen( filename );
+  
+  return strcmp( filename, "-" ) == 0 ||
+         (length >= 4 && strcmp( filename + length - 4, ".asm" ) == 0);
+}
@@ -0,0 +1,50 @@
+// The assembler as a library: source text in, machine code out. The
+// assembler command writes what it makes to an object file and a symbol
+// file; the simulator assembles a .asm file straight into its code area so
+// an edit and run doesn't need either of them.
+#ifndef ASSEMBLE_H_
+#define ASSEMBLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// a label and the word address it stands for
+struct ASSEMBLY_LABEL {
+  uint16_t address;
+  std::string name;
+};
+
+typedef struct ASSEMBLY_LABEL AssemblyLabel;
+
+/**
+ * assemble source text into machine code. Assembly stops when the code
+ * fills the buffer.
+ * @param source the text, need not end in a NUL
+ * @param code where the instructions go, big endian words
+ * @param capacity size of code in bytes
+ * @param filename the name used in error messages
+ * @param labels set to the labels in the order they are defined
+ * @param errors where a line of "file:line: what" is appended per mistake
+ * @return the number of bytes of code, or -1 if there were mistakes
+ */
+int assemble(const char *source, size_t size, uint8_t *code, int capacity,
+             const char *filename, std::vector<AssemblyLabel> &labels,
+             std::string &errors);
+
+/**
+ * assemble a source file as assemble() does, or standard input for "-"
+ * @return the number of bytes of code, or -1 if the file can't be read
+ *         (with a line in errors saying so) or there were mistakes
+ */
+int assemble_file(const char *filename, uint8_t *code, int capacity,
+                  std::vector<AssemblyLabel> &labels, std::string &errors);
+
+/**
+ * @return whether the simulator should assemble a code file rather than
+ *         load it: "-" for standard input, or a name ending in .asm
+ */
+bool is_assembly_source(const char *filename);
+
+#endif  // ASSEMBLE_H_
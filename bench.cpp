@@ -0,0 +1,491 @@
+// Simulator throughput benchmark. Runs the sample programs and a few
+// generated long-running kernels on every engine, timing the load, the run
+// and the memory dump of each separately, and reports simulated instructions
+// per second as a table or as JSON for tracking between builds.
+//
+// With --check it times nothing, and instead runs the same programs on every
+// engine, with and without fusion and on both machine sizes, failing if any
+// of them stops differently or leaves a different data area than the phase
+// engine.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "machine.h"
+
+using namespace std;
+
+// the names of the engines, in the order of ENGINES
+const static char *ENGINES_STR[]{"phase", "threaded", "jit", "lockstep"};
+
+// times each workload is run, the fastest run counts
+#define BENCH_REPEATS 3
+// the outer loop of the generated kernels, their inner loops run 65536 times
+// per outer one. 15 keeps every address under the infinite loop threshold.
+#define KERNEL_OUTER_LOOPS 15
+
+// a program and data file to run
+struct WORKLOAD {
+  string name;
+  string code_filename;
+  string data_filename;
+};
+
+typedef struct WORKLOAD Workload;
+
+// what one workload took on one engine
+struct RESULT {
+  string workload;
+  Engine engine;
+  Phase phase;           // what stopped it
+  int64_t instructions;  // per run
+  double load_ns;        // reset and both files
+  double run_ns;
+  double dump_ns;        // the stop reason and memory dump
+};
+
+typedef struct RESULT Result;
+
+/////////////////////////////////////////////////
+// generated kernels
+
+// the register operand of a register form instruction, in the right field
+#define REG(r) ((r) << 2)
+
+/**
+ * encode one instruction
+ * @param category one of OPCODES
+ * @param type the opcode type within the category
+ * @param left the left register
+ * @param right the 6 bit literal, branch offset or REG() operand
+ */
+static uint16_t encode(int category, int type, int left, int right) {
+  return (category << 3 | type) << 10 | left << 6 | (right & 0b111111);
+}
+
+/**
+ * wrap a loop body in the two counted loops every kernel uses: R5 counts
+ * the inner loop down from 65536, R6 the outer one from KERNEL_OUTER_LOOPS,
+ * and R0 stays 0 for the branches to compare against. The program stops on
+ * the illegal instruction after it.
+ * @param setup instructions run once first
+ * @param body the inner loop
+ */
+static vector<uint16_t> counted_loops(const vector<uint16_t> &setup,
+                                      const vector<uint16_t> &body) {
+  vector<uint16_t> code;
+  int outer;
+  int inner;
+
+  code.push_back(encode(MOVE_OPCODE, 0, 0, 0));
+  code.push_back(encode(MOVE_OPCODE, 0, 6, KERNEL_OUTER_LOOPS));
+  code.insert(code.end(), setup.begin(), setup.end());
+  outer = code.size();
+  code.push_back(encode(MOVE_OPCODE, 0, 5, 0));
+  inner = code.size();
+  code.insert(code.end(), body.begin(), body.end());
+  code.push_back(encode(SUB_OPCODE, 0, 5, 1));
+  code.push_back(encode(BRANCH_OPCODE, 2, 5, inner - (int)code.size()));
+  code.push_back(encode(SUB_OPCODE, 0, 6, 1));
+  code.push_back(encode(BRANCH_OPCODE, 2, 6, outer - (int)code.size()));
+  return code;
+}
+
+/**
+ * Fibonacci numbers written round the first 32 data words, as in test1
+ */
+static vector<uint16_t> fibonacci_kernel() {
+  return counted_loops(
+      {
+          encode(MOVE_OPCODE, 0, 2, 0),  // R2, R3: the last two numbers
+          encode(MOVE_OPCODE, 0, 3, 1),
+          encode(MOVE_OPCODE, 0, 7, 31),  // R7: address mask
+      },
+      {
+          encode(ADD_OPCODE, 0, 1, 1),  // R1: the address
+          encode(AND_OPCODE, 1, 1, REG(7)),
+          encode(MOVE_OPCODE, 0, 4, 0),
+          encode(OR_OPCODE, 1, 4, REG(3)),
+          encode(ADD_OPCODE, 1, 3, REG(2)),
+          encode(MOVE_OPCODE, 0, 2, 0),
+          encode(OR_OPCODE, 1, 2, REG(4)),
+          encode(MOVE_OPCODE, 0b101, 1, REG(3)),
+      });
+}
+
+/**
+ * scan the first 32 data words over and over, counting the ones that hold
+ * the key
+ */
+static vector<uint16_t> search_kernel() {
+  return counted_loops(
+      {
+          encode(MOVE_OPCODE, 0, 2, 7),   // R2: the key
+          encode(MOVE_OPCODE, 0, 7, 31),  // R7: address mask
+      },
+      {
+          encode(MOVE_OPCODE, 1, 3, REG(1)),  // R1: the address
+          encode(XOR_OPCODE, 1, 3, REG(2)),
+          encode(BRANCH_OPCODE, 2, 3, 2),  // skip the count if no match
+          encode(ADD_OPCODE, 0, 8, 1),     // R8: matches
+          encode(ADD_OPCODE, 0, 1, 1),
+          encode(AND_OPCODE, 1, 1, REG(7)),
+      });
+}
+
+/**
+ * copy the first 32 data words to the 32 after them, over and over
+ */
+static vector<uint16_t> copy_kernel() {
+  return counted_loops(
+      {
+          encode(MOVE_OPCODE, 0, 7, 31),  // R7: address mask
+      },
+      {
+          encode(MOVE_OPCODE, 1, 3, REG(1)),  // R1: the source
+          encode(MOVE_OPCODE, 0, 9, 0),       // R9: the destination
+          encode(OR_OPCODE, 1, 9, REG(1)),
+          encode(ADD_OPCODE, 0, 9, 16),
+          encode(ADD_OPCODE, 0, 9, 16),
+          encode(MOVE_OPCODE, 0b101, 9, REG(3)),
+          encode(ADD_OPCODE, 0, 1, 1),
+          encode(AND_OPCODE, 1, 1, REG(7)),
+      });
+}
+
+/**
+ * a JR of R0 straight away, to 0 - 1: on a 64K word code area that is
+ * 0xFFFF, a real address that must stop on its illegal instruction like any
+ * other
+ */
+static vector<uint16_t> last_address_kernel() {
+  return {encode(BRANCH_OPCODE, 0, 0, 0)};
+}
+
+/**
+ * write a generated kernel and a data image counting up from 0 for it
+ * @return false if the files can't be written
+ */
+static bool write_kernel(const string &code_filename,
+                         const string &data_filename,
+                         const vector<uint16_t> &code) {
+  FILE *file = fopen(code_filename.c_str(), "wb");
+  uint8_t data[DATA_SIZE][WORD_SIZE];
+  bool rc;
+
+  if (!file) return false;
+  for (uint16_t word : code) {
+    // big endian
+    fputc(word >> 8, file);
+    fputc(word & 0xFF, file);
+  }
+  rc = fclose(file) == 0;
+  for (int i = 0; i < DATA_SIZE; i++) {
+    data[i][0] = 0;
+    data[i][1] = i % 16;
+  }
+  return rc && write_data_image(data_filename.c_str(), data, DATA_SIZE);
+}
+
+/////////////////////////////////////////////////
+// measuring
+
+typedef chrono::steady_clock Clock;
+
+static double elapsed_ns(Clock::time_point start) {
+  return chrono::duration<double, nano>(Clock::now() - start).count();
+}
+
+/**
+ * @return the instructions the last run executed, from the per address
+ *         counts every engine keeps
+ */
+static int64_t instructions_run(const Machine &m) {
+  int64_t count = 0;
+
+  for (int i = 0; i < CODE_SIZE; i++) {
+    // an engine may count the illegal instruction it stopped on
+    if (decode_word(m.code[i], i).handler != ILLEGAL_HANDLER) {
+      count += m.loop_counts[i];
+    }
+  }
+  return count;
+}
+
+/**
+ * run a workload BENCH_REPEATS times and keep the fastest of each part
+ * @return false if its files can't be loaded
+ */
+static bool measure(Machine &m, const Workload &workload,
+                    const RunOptions &options, Result &result) {
+  result.workload = workload.name;
+  result.engine = options.engine;
+  result.load_ns = result.run_ns = result.dump_ns = 1e300;
+  for (int i = 0; i < BENCH_REPEATS; i++) {
+    Clock::time_point start = Clock::now();
+    string out;
+
+    m.reset();
+    if (!m.load(workload.code_filename.c_str(),
+                workload.data_filename.c_str())) {
+      return false;
+    }
+    m.reset_loop_detection();
+    result.load_ns = min(result.load_ns, elapsed_ns(start));
+
+    start = Clock::now();
+    result.phase = m.run(options);
+    result.run_ns = min(result.run_ns, elapsed_ns(start));
+
+    start = Clock::now();
+    m.report(result.phase, out);
+    result.dump_ns = min(result.dump_ns, elapsed_ns(start));
+  }
+  result.instructions = instructions_run(m);
+  return true;
+}
+
+/**
+ * run a workload on every engine and compare the stop reason and memory dump
+ * of each with the phase engine's, and the profile too for a lockstep batch
+ * @param machine the name of M, for the messages
+ * @return the number of runs that differ, or -1 if the workload can't be
+ *         loaded
+ */
+template <class M>
+static int check(const Workload &workload, const char *machine) {
+  // the phase engine first, it is what the others are held to
+  static const struct {
+    Engine engine;
+    bool fusion;
+  } RUNS[] = {{PHASE_ENGINE, true},
+              {THREADED_ENGINE, true},
+              {THREADED_ENGINE, false},
+              {JIT_ENGINE, true},
+              {LOCKSTEP_ENGINE, true}};
+  unique_ptr<M> m(new M);
+  unique_ptr<M> batch[2] = {unique_ptr<M>(new M), unique_ptr<M>(new M)};
+  M *lanes[2] = {batch[0].get(), batch[1].get()};
+  Phase results[2];
+  string expected;
+  string profile;
+  int differences = 0;
+
+  for (auto &run : RUNS) {
+    RunOptions options = {run.engine, run.fusion, false, false, HEX_DUMP};
+    string out;
+
+    m->reset();
+    if (!m->load(workload.code_filename.c_str(),
+                 workload.data_filename.c_str())) {
+      return -1;
+    }
+    m->reset_loop_detection();
+    m->report(m->run(options), out);
+    if (run.engine == PHASE_ENGINE) {
+      expected = out;
+      m->print_profile(profile, {});
+    } else if (out != expected) {
+      fprintf(stderr, "%s: the %s engine%s on a %s differs from the phase "
+              "engine\n",
+              workload.name.c_str(), ENGINES_STR[run.engine],
+              run.fusion ? "" : " without fusion", machine);
+      differences++;
+    }
+  }
+
+  // a batch the way the simulator runs one: the program is only loaded into
+  // the first lane, and every lane must still report and profile the run
+  for (auto &lane : batch) lane->reset();
+  if (!batch[0]->load_code(workload.code_filename.c_str())) return -1;
+  for (M *lane : lanes) {
+    if (!lane->load_data(workload.data_filename.c_str())) return -1;
+    lane->reset_loop_detection();
+  }
+  run_lockstep(lanes, 2, *batch[0], results);
+  for (int l = 0; l < 2; l++) {
+    string out;
+
+    lanes[l]->print_profile(out, {});
+    lanes[l]->report(results[l], out);
+    if (out != profile + expected) {
+      fprintf(stderr, "%s: lane %d of a lockstep batch on a %s differs from "
+              "the phase engine\n",
+              workload.name.c_str(), l, machine);
+      differences++;
+    }
+  }
+  return differences;
+}
+
+static void print_table(const vector<Result> &results) {
+  printf("%-12s %-9s %12s %10s %10s %10s %10s\n", "workload", "engine",
+         "instructions", "MIPS", "ns/instr", "load us", "dump us");
+  for (auto &r : results) {
+    printf("%-12s %-9s %12lld %10.1f %10.2f %10.1f %10.1f\n",
+           r.workload.c_str(), ENGINES_STR[r.engine],
+           (long long)r.instructions, r.instructions * 1e3 / r.run_ns,
+           r.run_ns / max<int64_t>(r.instructions, 1), r.load_ns / 1e3,
+           r.dump_ns / 1e3);
+  }
+}
+
+static void print_json(const vector<Result> &results) {
+  printf("{\n  \"results\": [");
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &r = results[i];
+
+    printf(
+        "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", "
+        "\"instructions\": %lld, \"run_ns\": %.0f, \"load_ns\": %.0f, "
+        "\"dump_ns\": %.0f, \"mips\": %.3f, \"ns_per_instruction\": %.3f}",
+        i ? "," : "", r.workload.c_str(), ENGINES_STR[r.engine],
+        (long long)r.instructions, r.run_ns, r.load_ns, r.dump_ns,
+        r.instructions * 1e3 / r.run_ns,
+        r.run_ns / max<int64_t>(r.instructions, 1));
+  }
+  printf("\n  ]\n}\n");
+}
+
+int main(int argc, const char *argv[]) {
+  // the sample programs with a data file each
+  static const char *const SAMPLES[][2] = {
+      {"test1", "test1"}, {"test2", "test2-1"}, {"test3", "test3"},
+      {"test4", "test4"}, {"test5", "test5"},   {"test6", "test6-1"},
+      {"test7", "test7"}};
+  // the other data files of the samples, only checked so the timings stay
+  // comparable with earlier builds
+  static const char *const MORE_SAMPLES[][2] = {
+      {"test2", "test2-2"}, {"test6", "test6-2"}, {"test6", "test6-3"}};
+  const char *samples_directory = "samples";
+  const char *work_directory = ".";
+  bool engines[NUM_ENGINES] = {};
+  bool any_engine = false;
+  bool json = false;
+  bool checking = false;
+  RunOptions options = {PHASE_ENGINE, true, false, false, HEX_DUMP};
+  vector<Workload> workloads;
+  vector<Result> results;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      checking = true;
+    } else if (strcmp(argv[i], "--no-fusion") == 0) {
+      options.fusion = false;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      i++;
+      for (int e = 0; e < NUM_ENGINES; e++) {
+        if (strcmp(argv[i], ENGINES_STR[e]) == 0) {
+          engines[e] = any_engine = true;
+        }
+      }
+    } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      samples_directory = argv[++i];
+    } else if (strcmp(argv[i], "--work") == 0 && i + 1 < argc) {
+      work_directory = argv[++i];
+    } else {
+      printf(
+          "usage: %s [--json] [--engine name]... [--no-fusion] "
+          "[--samples dir]\n"
+          "          [--work dir]\n"
+          "       %s --check [--samples dir] [--work dir]\n",
+          argv[0], argv[0]);
+      return 1;
+    }
+  }
+  if (!any_engine) fill(engines, engines + NUM_ENGINES, true);
+
+  int missing = 0;  // samples that couldn't be found
+  auto add_sample = [&](const char *const sample[2]) {
+    string code_filename = string(samples_directory) + "/" + sample[0] + ".o";
+    FILE *code = fopen(code_filename.c_str(), "rb");
+
+    // the object files come from the assembler, so a timing run can do
+    // without one, but a check that leaves a sample out proves nothing
+    if (!code) {
+      fprintf(stderr, "%s %s, no %s\n", checking ? "cannot check" : "skipping",
+              sample[1], code_filename.c_str());
+      missing++;
+      return;
+    }
+    fclose(code);
+    workloads.push_back({sample[1], code_filename,
+                         string(samples_directory) + "/" + sample[1] +
+                             ".dat"});
+  };
+
+  for (auto &sample : SAMPLES) add_sample(sample);
+  if (checking) {
+    for (auto &sample : MORE_SAMPLES) add_sample(sample);
+  }
+
+  struct {
+    const char *name;
+    vector<uint16_t> (*generate)();
+    bool check_only;  // a corner case, not worth timing
+  } kernels[] = {{"fibonacci", fibonacci_kernel, false},
+                 {"search", search_kernel, false},
+                 {"copy", copy_kernel, false},
+                 {"last_address", last_address_kernel, true}};
+
+  for (auto &kernel : kernels) {
+    if (kernel.check_only && !checking) continue;
+    string base = string(work_directory) + "/bench_" + kernel.name;
+    Workload workload = {kernel.name, base + ".o", base + ".dat"};
+
+    if (!write_kernel(workload.code_filename, workload.data_filename,
+                      kernel.generate())) {
+      fprintf(stderr, "cannot write %s\n", workload.code_filename.c_str());
+      return 1;
+    }
+    workloads.push_back(workload);
+  }
+
+  if (checking) {
+    int differences = 0;
+
+    for (auto &workload : workloads) {
+      int small = check<Machine>(workload, "Machine");
+      int large = check<LargeMachine>(workload, "LargeMachine");
+
+      if (small < 0 || large < 0) {
+        fprintf(stderr, "cannot load %s\n", workload.name.c_str());
+        return 1;
+      }
+      differences += small + large;
+    }
+    printf("%d workloads checked, %d runs differ from the phase engine\n",
+           (int)workloads.size(), differences);
+    if (missing) printf("%d samples missing\n", missing);
+    return differences || missing ? 1 : 0;
+  }
+
+  unique_ptr<Machine> machine(new Machine);
+
+  for (auto &workload : workloads) {
+    for (int e = 0; e < NUM_ENGINES; e++) {
+      Result result;
+
+      if (!engines[e]) continue;
+      options.engine = (Engine)e;
+      if (!measure(*machine, workload, options, result)) {
+        fprintf(stderr, "cannot load %s\n", workload.name.c_str());
+        return 1;
+      }
+      results.push_back(result);
+    }
+  }
+  if (json) {
+    print_json(results);
+  } else {
+    print_table(results);
+  }
+  return 0;
+}
@@ -0,0 +1,529 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "mapped_file.h"
+
+using namespace std;
+
+/**
+ * append a number, little endian
+ * @param bytes how many bytes of it
+ */
+static void put(string &out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) out += (char)(value >> i * 8 & 0xFF);
+}
+
+/**
+ * read a number written by put() and move past it
+ */
+static uint64_t get(const uint8_t *&p, int bytes) {
+  uint64_t value = 0;
+
+  for (int i = 0; i < bytes; i++) value |= (uint64_t)p[i] << i * 8;
+  p += bytes;
+  return value;
+}
+
+// FNV-1a over a record
+static uint32_t checksum(const uint8_t *bytes, size_t size) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * append a list of runs of the addresses below size that changed
+ * @param changed called as changed(address)
+ * @param value called as value(address, out) to append what is there now
+ */
+template <class Changed, class Value>
+static void put_runs(string &out, int size, Changed changed, Value value) {
+  string runs;
+  uint32_t count = 0;
+
+  for (int i = 0; i < size; i++) {
+    if (!changed(i)) continue;
+
+    int first = i;
+
+    while (i < size && changed(i)) i++;
+    put(runs, first, 4);
+    put(runs, i - first, 4);
+    for (int j = first; j < i; j++) value(j, runs);
+    count++;
+  }
+  put(out, count, 4);
+  out += runs;
+}
+
+/**
+ * go through a list of runs written by put_runs()
+ * @param value_size bytes per value
+ * @param apply called as apply(address, value bytes) for each value
+ * @return false if the list runs past end or past size
+ */
+template <class Apply>
+static bool get_runs(const uint8_t *&p, const uint8_t *end, int size,
+                     int value_size, Apply apply) {
+  if (end - p < 4) return false;
+
+  uint32_t count = get(p, 4);
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (end - p < 8) return false;
+
+    uint32_t first = get(p, 4);
+    uint32_t length = get(p, 4);
+
+    if (first > (uint32_t)size || length > (uint32_t)size - first ||
+        (uint64_t)(end - p) < (uint64_t)length * value_size) {
+      return false;
+    }
+    for (uint32_t j = 0; j < length; j++) {
+      apply(first + j, p);
+      p += value_size;
+    }
+  }
+  return true;
+}
+
+/**
+ * append the labels of the code area, as a number of labels and for each its
+ * address, the length of its name and the name
+ * @param labels a label or an empty string for each code address
+ */
+static void put_labels(string &out, const vector<string> &labels) {
+  string names;
+  uint32_t count = 0;
+
+  for (size_t i = 0; i < labels.size(); i++) {
+    if (labels[i].empty()) continue;
+    put(names, i, 4);
+    put(names, labels[i].size(), 4);
+    names += labels[i];
+    count++;
+  }
+  put(out, count, 4);
+  out += names;
+}
+
+/**
+ * read labels written by put_labels()
+ * @param labels given a label for each of the size code addresses if there
+ *               are any, left alone if there are none
+ * @return false if the labels run past end or past size
+ */
+static bool get_labels(const uint8_t *&p, const uint8_t *end, int size,
+                       vector<string> &labels) {
+  if (end - p < 4) return false;
+
+  uint32_t count = get(p, 4);
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (end - p < 8) return false;
+
+    uint32_t address = get(p, 4);
+    uint32_t length = get(p, 4);
+
+    if (address >= (uint32_t)size || (uint64_t)(end - p) < length) {
+      return false;
+    }
+    labels.resize(size);
+    labels[address].assign((const char *)p, length);
+    p += length;
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////
+// the file
+
+bool CheckpointFile::open(const char *filename,
+                          const CheckpointHeader &header, size_t append_at) {
+  close();
+  if (append_at > 0) {
+    fd_ = ::open(filename, O_WRONLY);
+    // a record that didn't make it all the way out goes
+    if (fd_ >= 0 && (ftruncate(fd_, append_at) != 0 ||
+                     lseek(fd_, append_at, SEEK_SET) < 0)) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  } else {
+    fd_ = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd_ >= 0 &&
+        !write_all(fd_, reinterpret_cast<const char *>(&header),
+                   sizeof header)) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+  if (fd_ < 0) return false;
+  failed_ = false;
+  stop_ = false;
+  writer_ = std::thread(&CheckpointFile::drain, this);
+  return true;
+}
+
+void CheckpointFile::append(string &&record) {
+  string framed;
+
+  put(framed, record.size(), 4);
+  put(framed, checksum(reinterpret_cast<const uint8_t *>(record.data()),
+                       record.size()),
+      4);
+  framed += record;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    records_.push_back(std::move(framed));
+  }
+  waiting_.notify_one();
+}
+
+bool CheckpointFile::close() {
+  bool rc;
+
+  if (fd_ < 0) return true;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    stop_ = true;
+  }
+  waiting_.notify_one();
+  writer_.join();
+  rc = ::close(fd_) == 0 && !failed_;
+  fd_ = -1;
+  return rc;
+}
+
+void CheckpointFile::drain() {
+  std::unique_lock<std::mutex> guard(lock_);
+
+  for (;;) {
+    waiting_.wait(guard, [this] { return stop_ || !records_.empty(); });
+    if (records_.empty()) return;
+
+    string record = std::move(records_.front());
+
+    records_.pop_front();
+    guard.unlock();
+    // on the disk before the next one goes after it
+    if (!write_all(fd_, record.data(), record.size()) || fsync(fd_) != 0) {
+      failed_ = true;
+    }
+    guard.lock();
+  }
+}
+
+/////////////////////////////////////////////////
+// checkpoints
+
+/**
+ * the header for a machine's checkpoint file
+ */
+template <class M>
+static CheckpointHeader checkpoint_header() {
+  CheckpointHeader header = {};
+
+  memcpy(header.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE);
+  header.version = CHECKPOINT_VERSION;
+  for (int i = 0; i < 4; i++) {
+    header.code_words[i] = (uint32_t)M::CODE_WORDS >> i * 8 & 0xFF;
+    header.data_words[i] = (uint32_t)M::DATA_WORDS >> i * 8 & 0xFF;
+  }
+  return header;
+}
+
+template <class M>
+bool Checkpointer<M>::open(const char *filename, const M &m,
+                           const vector<string> &labels, double period,
+                           size_t append_at) {
+  period_ = period;
+  pause_.store(0, std::memory_order_relaxed);
+  preempted_ = 0;
+  data_.assign(M::DATA_WORDS * WORD_SIZE, 0xFF);
+  stored_.assign(sizeof m.loop_detector.stored / sizeof(uint64_t), 0);
+  counts_.assign(M::CODE_WORDS + 1, 0);
+  taken_.assign(M::CODE_WORDS, 0);
+  if (!file_.open(filename, checkpoint_header<M>(), append_at)) return false;
+  if (append_at > 0) {
+    // the file already has everything up to here
+    m.data.read(0, M::DATA_WORDS,
+                reinterpret_cast<uint8_t(*)[WORD_SIZE]>(data_.data()));
+    memcpy(stored_.data(), m.loop_detector.stored,
+           sizeof m.loop_detector.stored);
+    memcpy(counts_.data(), m.loop_counts, sizeof m.loop_counts);
+    memcpy(taken_.data(), m.taken_counts, sizeof m.taken_counts);
+  } else {
+    // the data as it was loaded comes first, so a diff dump after restoring
+    // still shows what the run changed, then where the machine is now
+    labels_ = &labels;
+    checkpoint(m, true);
+    labels_ = nullptr;
+    checkpoint(m, false);
+  }
+  return true;
+}
+
+template <class M>
+void Checkpointer<M>::checkpoint(const M &m, bool first) {
+  const auto &detector = m.loop_detector;
+  string record;
+
+  for (int i = 0; i < REGISTERS; i++) put(record, m.registers_general[i], 2);
+  put(record, m.register_pc, 2);
+  put(record, m.instruction_counter, 8);
+  // the loop detector as it is, so a program stuck in a loop is caught at
+  // the same instruction as it would have been without the checkpoint
+  put(record, (uint32_t)detector.countdown, 4);
+  put(record, (uint32_t)detector.power, 4);
+  put(record, detector.saved_pc, 4);
+  for (int i = 0; i < REGISTERS; i++) {
+    put(record, detector.saved_registers[i], 2);
+  }
+  put(record, detector.saved_data_hash, 8);
+
+  // the code never changes after the first record
+  put_runs(
+      record, first ? M::CODE_WORDS : 0,
+      [&](int i) { return m.code[i][0] != 0xFF || m.code[i][1] != 0xFF; },
+      [&](int i, string &out) { out.append((const char *)m.code[i], 2); });
+
+  // the first record has all of the data area as it was loaded, the rest
+  // the words stored to since the last one that are new or have changed
+  const typename M::DataArea &data = first ? m.loaded_data : m.data;
+
+  put_runs(
+      record, M::DATA_WORDS,
+      [&](int i) {
+        if (first) {
+          return memcmp(data.word(i), &data_[i * WORD_SIZE], WORD_SIZE) != 0;
+        }
+        return (detector.stored[i / 64] >> (i % 64) & 1) &&
+               (!(stored_[i / 64] >> (i % 64) & 1) ||
+                memcmp(data.word(i), &data_[i * WORD_SIZE], WORD_SIZE) != 0);
+      },
+      [&](int i, string &out) {
+        out.append((const char *)data.word(i), WORD_SIZE);
+        memcpy(&data_[i * WORD_SIZE], data.word(i), WORD_SIZE);
+      });
+  if (!first) {
+    memcpy(stored_.data(), detector.stored, sizeof detector.stored);
+  }
+
+  put_runs(
+      record, M::CODE_WORDS + 1,
+      [&](int i) { return m.loop_counts[i] != counts_[i]; },
+      [&](int i, string &out) {
+        put(out, (uint32_t)m.loop_counts[i], 4);
+        counts_[i] = m.loop_counts[i];
+      });
+  put_runs(
+      record, M::CODE_WORDS,
+      [&](int i) { return m.taken_counts[i] != taken_[i]; },
+      [&](int i, string &out) {
+        put(out, (uint32_t)m.taken_counts[i], 4);
+        taken_[i] = m.taken_counts[i];
+      });
+
+  // the detector's snapshot of the data area, as the words that aren't
+  // what is in the data area now
+  put_runs(
+      record,
+      detector.saved_pc == LOOP_DETECTOR_NO_PC ? 0 : M::DATA_WORDS,
+      [&](int i) {
+        return memcmp(detector.saved_data.word(i), data.word(i), WORD_SIZE) !=
+               0;
+      },
+      [&](int i, string &out) {
+        out.append((const char *)detector.saved_data.word(i), WORD_SIZE);
+      });
+
+  // the labels go with the code, a restored profile names its hot spots
+  // even where there is no symbol file
+  put_labels(record, first ? *labels_ : vector<string>());
+
+  file_.append(std::move(record));
+}
+
+template <class M>
+Phase Checkpointer<M>::run(M &m, const RunOptions &options) {
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done = false;
+  Phase phase;
+
+  // the run pauses every period, the timer only asks it to
+  std::thread timer([&] {
+    std::unique_lock<std::mutex> guard(lock);
+    auto period = std::chrono::duration<double>(period_);
+
+    while (!finished.wait_for(guard, period, [&] { return done; })) {
+      pause_.store(1, std::memory_order_relaxed);
+    }
+  });
+
+  m.pause = &pause_;
+  while ((phase = m.run(options)) == PAUSED) {
+    pause_.store(0, std::memory_order_relaxed);
+    checkpoint(m, false);
+    if (preempted_) break;
+  }
+  m.pause = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+
+    done = true;
+  }
+  finished.notify_one();
+  timer.join();
+  return phase;
+}
+
+template <class M>
+bool restore_checkpoint(M &m, const char *filename, vector<string> &labels,
+                        size_t &append_at) {
+  MappedFile file(filename);
+  CheckpointHeader header;
+  CheckpointHeader expected = checkpoint_header<M>();
+  size_t offset = sizeof header;
+  int records = 0;
+  auto &detector = m.loop_detector;
+
+  m.reset();
+  labels.clear();
+  if (!file.is_open()) {
+    snprintf(m.load_error, sizeof m.load_error, "cannot read %s", filename);
+    return false;
+  }
+  if (file.size() < sizeof header ||
+      memcmp(file.bytes(), CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE) != 0 ||
+      file.bytes()[CHECKPOINT_MAGIC_SIZE] != CHECKPOINT_VERSION) {
+    snprintf(m.load_error, sizeof m.load_error,
+             "%s is not a checkpoint this version can read", filename);
+    return false;
+  }
+  memcpy(&header, file.bytes(), sizeof header);
+  if (memcmp(header.code_words, expected.code_words, 4) != 0 ||
+      memcmp(header.data_words, expected.data_words, 4) != 0) {
+    snprintf(m.load_error, sizeof m.load_error,
+             "%s is a checkpoint of a machine of another size", filename);
+    return false;
+  }
+
+  // every whole record in turn, the first holds the machine as loaded
+  while (file.size() - offset >= CHECKPOINT_RECORD_HEADER_SIZE) {
+    const uint8_t *p = file.bytes() + offset;
+    uint32_t size = get(p, 4);
+    uint32_t sum = get(p, 4);
+    const uint8_t *end = p + size;
+    bool first = records == 0;
+
+    if (file.size() - offset - CHECKPOINT_RECORD_HEADER_SIZE < size ||
+        checksum(p, size) != sum) {
+      break;
+    }
+    if (size < CHECKPOINT_RECORD_FIXED_SIZE) {
+      snprintf(m.load_error, sizeof m.load_error, "%s is damaged", filename);
+      return false;
+    }
+    for (int i = 0; i < REGISTERS; i++) m.registers_general[i] = get(p, 2);
+    m.register_pc = get(p, 2);
+    m.instruction_counter = get(p, 8);
+    detector.countdown = (int32_t)get(p, 4);
+    detector.power = (int32_t)get(p, 4);
+    detector.saved_pc = get(p, 4);
+    for (int i = 0; i < REGISTERS; i++) {
+      detector.saved_registers[i] = get(p, 2);
+    }
+    detector.saved_data_hash = get(p, 8);
+    bool sound =
+        get_runs(p, end, M::CODE_WORDS, WORD_SIZE,
+                 [&](int i, const uint8_t *word) {
+                   memcpy(m.code[i], word, WORD_SIZE);
+                 }) &&
+        get_runs(p, end, M::DATA_WORDS, WORD_SIZE,
+                 [&](int i, const uint8_t *word) {
+                   // the loaded data goes straight in, what the run
+                   // stored goes through the loop detection
+                   if (first) {
+                     memcpy(m.data.writable(i), word, WORD_SIZE);
+                   } else {
+                     m.patch_data(i, word[0] << 8 | word[1]);
+                   }
+                 });
+    if (sound && first) {
+      // reset_loop_detection() starts the detector over, what was just
+      // read of it goes back in
+      auto countdown = detector.countdown;
+      auto power = detector.power;
+      auto saved_pc = detector.saved_pc;
+      auto saved_data_hash = detector.saved_data_hash;
+      uint16_t saved_registers[REGISTERS];
+
+      memcpy(saved_registers, detector.saved_registers,
+             sizeof saved_registers);
+      for (int i = 0; i < M::CODE_WORDS; i++) {
+        m.decoded[i] = decode_word(m.code[i], i);
+      }
+      m.reset_loop_detection();
+      detector.countdown = countdown;
+      detector.power = power;
+      detector.saved_pc = saved_pc;
+      detector.saved_data_hash = saved_data_hash;
+      memcpy(detector.saved_registers, saved_registers,
+             sizeof saved_registers);
+    }
+    sound = sound &&
+            get_runs(p, end, M::CODE_WORDS + 1, 4,
+                     [&](int i, const uint8_t *count) {
+                       m.loop_counts[i] = (int32_t)get(count, 4);
+                     }) &&
+            get_runs(p, end, M::CODE_WORDS, 4,
+                     [&](int i, const uint8_t *count) {
+                       m.taken_counts[i] = (int32_t)get(count, 4);
+                     });
+    if (sound) {
+      bool snapshot = detector.saved_pc != LOOP_DETECTOR_NO_PC;
+
+      if (snapshot) detector.saved_data = m.data;
+      sound = get_runs(p, end, snapshot ? M::DATA_WORDS : 0, WORD_SIZE,
+                       [&](int i, const uint8_t *word) {
+                         memcpy(detector.saved_data.writable(i), word,
+                                WORD_SIZE);
+                       });
+    }
+    sound = sound && get_labels(p, end, first ? M::CODE_WORDS : 0, labels) &&
+            p == end;
+    if (!sound) {
+      snprintf(m.load_error, sizeof m.load_error, "%s is damaged", filename);
+      return false;
+    }
+    offset += CHECKPOINT_RECORD_HEADER_SIZE + size;
+    records++;
+  }
+  if (records == 0) {
+    snprintf(m.load_error, sizeof m.load_error, "%s has no checkpoint in it",
+             filename);
+    return false;
+  }
+  append_at = offset;
+  return true;
+}
+
+template class Checkpointer<Machine>;
+template class Checkpointer<LargeMachine>;
+template bool restore_checkpoint(Machine &m, const char *filename,
+                                 vector<string> &labels, size_t &append_at);
+template bool restore_checkpoint(LargeMachine &m, const char *filename,
+                                 vector<string> &labels, size_t &append_at);
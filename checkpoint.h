@@ -0,0 +1,198 @@
+// Checkpoints of long runs, so a run can be stopped and carried on later, on
+// this host or another. A checkpoint file starts with the whole machine as it
+// was loaded; after that, every few seconds the run pauses at a taken branch
+// and a record of what changed since the last one is appended: the registers,
+// the PC, the instruction counter, the loop counts that moved and the data
+// words that are different, found through the loop detector's bitmap of
+// stored words. The records are put together while the run is paused but
+// written out and synced on a thread of their own.
+//
+// A record is only used on restore once all of it is in the file, so a crash
+// in the middle of writing one costs nothing but the last few seconds. The
+// loop detector and the profile counts go into the records too, so a run
+// that is restored stops and reports exactly as it would have without.
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "machine.h"
+
+// the first bytes of every checkpoint file
+#define CHECKPOINT_MAGIC "S5CK"
+#define CHECKPOINT_MAGIC_SIZE 4
+#define CHECKPOINT_VERSION 2
+// seconds between checkpoints unless asked for something else
+#define CHECKPOINT_PERIOD 60
+
+// The file header, all single bytes like the image header. Every number in
+// the file is little endian, the data and code words are big endian as in
+// the machine, so a checkpoint can be restored on any host.
+struct CHECKPOINT_HEADER {
+  char magic[CHECKPOINT_MAGIC_SIZE];  // CHECKPOINT_MAGIC
+  uint8_t version;                    // CHECKPOINT_VERSION
+  uint8_t reserved[3];                // 0
+  uint8_t code_words[4];              // size of the machine's code area
+  uint8_t data_words[4];              // and of its data area
+};
+
+typedef struct CHECKPOINT_HEADER CheckpointHeader;
+
+// Each record is its size and an FNV-1a checksum of what follows, 4 bytes
+// each. Then come the registers, the PC, the instruction counter and the
+// loop detector's counters and snapshot of the registers, and five lists of
+// runs of words that changed: code words (only in the first record), data
+// words, loop counts, taken branch counts and the words of the loop
+// detector's snapshot that aren't what is in the data area. A list is its
+// number of runs, and a run is its first address, its length and the values.
+// Last come the labels of the code area for profiles, again only in the
+// first record: their number, then the address, length and name of each.
+#define CHECKPOINT_RECORD_HEADER_SIZE 8
+// the part of a record before the lists
+#define CHECKPOINT_RECORD_FIXED_SIZE (REGISTERS * 2 + 2 + 8 + 4 + 4 + 4 + \
+                                      REGISTERS * 2 + 8)
+
+// appends records to a checkpoint file on a thread of its own
+class CheckpointFile {
+ public:
+  CheckpointFile() : fd_(-1), failed_(false), stop_(false) {}
+  ~CheckpointFile() { close(); }
+
+  CheckpointFile(const CheckpointFile &) = delete;
+  CheckpointFile &operator=(const CheckpointFile &) = delete;
+
+  /**
+   * create the file, or carry on with one that is being restored from, and
+   * start the thread that writes it
+   * @param append_at 0 for a new file, or where the last whole record of an
+   *                  existing one ends, anything after it is cut off
+   * @return false if the file can't be written
+   */
+  bool open(const char *filename, const CheckpointHeader &header,
+            size_t append_at);
+
+  /**
+   * hand over a record (without its size and checksum) to be written
+   */
+  void append(std::string &&record);
+
+  /**
+   * write out the records still waiting and close the file
+   * @return false if any write failed
+   */
+  bool close();
+
+ private:
+  int fd_;
+  bool failed_;
+  bool stop_;
+  std::thread writer_;
+  std::mutex lock_;
+  std::condition_variable waiting_;
+  std::deque<std::string> records_;
+
+  // the writer thread, writes records until told to stop
+  void drain();
+};
+
+// What a run checks to know it should stop for a checkpoint. It doesn't
+// depend on the machine, so a signal handler can get at it.
+class CheckpointControl {
+ public:
+  CheckpointControl() : pause_(0), preempted_(0) {}
+
+  /**
+   * have the run stop for good at its next checkpoint, which is taken as
+   * soon as it can be. Safe to call from a signal handler.
+   */
+  void preempt() {
+    preempted_ = 1;
+    pause_.store(1, std::memory_order_relaxed);
+  }
+
+ protected:
+  std::atomic<uint16_t> pause_;
+  volatile sig_atomic_t preempted_;
+};
+
+template <class M>
+class Checkpointer : public CheckpointControl {
+ public:
+  Checkpointer() : period_(CHECKPOINT_PERIOD), labels_(nullptr) {}
+
+  /**
+   * start a checkpoint file for a machine that is ready to run
+   * @param labels a label or an empty string for each code address, or
+   *               none, kept for profiles of the restored run; not used when
+   *               carrying on with an existing file
+   * @param period seconds between checkpoints
+   * @param append_at 0 to start a new file with everything in the machine,
+   *                  or where restore_checkpoint() found the end of the file
+   *                  the machine was restored from, to carry on with it
+   * @return false if the file can't be written
+   */
+  bool open(const char *filename, const M &m,
+            const std::vector<std::string> &labels, double period,
+            size_t append_at);
+
+  /**
+   * run the machine as M::run() does, stopping every period for a
+   * checkpoint
+   * @return the Phase that stopped the processor, or PAUSED if the run was
+   *         preempted; the last checkpoint has everything then
+   */
+  Phase run(M &m, const RunOptions &options);
+
+  /**
+   * write out the checkpoints still waiting and close the file
+   * @return false if any write failed
+   */
+  bool close() { return file_.close(); }
+
+ private:
+  CheckpointFile file_;
+  double period_;
+  // the data words, which of them were stored to and the counts as of the
+  // last checkpoint
+  std::vector<uint8_t> data_;
+  std::vector<uint64_t> stored_;
+  std::vector<int32_t> counts_;
+  std::vector<int32_t> taken_;
+  // the labels for the first record, only while it is put together
+  const std::vector<std::string> *labels_;
+
+  // put together the changes since the last checkpoint and hand them over
+  void checkpoint(const M &m, bool first);
+};
+
+/**
+ * load a machine from a checkpoint file, as of its last whole record
+ * @param labels set to the labels of the code area the file was started
+ *               with, empty if it had none
+ * @param append_at set to where that record ends, for Checkpointer::open()
+ * @return false if the file can't be read, has no whole record or was made
+ *         for a machine of another size; load_error says which
+ */
+template <class M>
+bool restore_checkpoint(M &m, const char *filename,
+                        std::vector<std::string> &labels, size_t &append_at);
+
+// all are built in checkpoint.cpp
+extern template class Checkpointer<Machine>;
+extern template class Checkpointer<LargeMachine>;
+extern template bool restore_checkpoint(Machine &m, const char *filename,
+                                        std::vector<std::string> &labels,
+                                        size_t &append_at);
+extern template bool restore_checkpoint(LargeMachine &m, const char *filename,
+                                        std::vector<std::string> &labels,
+                                        size_t &append_at);
+
+#endif  // CHECKPOINT_H_
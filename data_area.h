@@ -0,0 +1,249 @@
+// The data area of a machine, in one of two layouts with the same interface
+// so the engines are written once for both. A dense area is a plain array,
+// the cheapest to reach and what the classic machine uses. A paged area only
+// holds the pages something has been stored to: every other page is the one
+// shared blank page that reads as 0xFFFF, so loads never need a check, and
+// a store allocates its page the first time it lands there. What it costs to
+// reset, copy, compare or dump a paged area grows with the pages a program
+// touched, not with the size of the address space.
+#ifndef DATA_AREA_H_
+#define DATA_AREA_H_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "isa.h"
+
+// words in one page of a paged data area
+#define DATA_PAGE_WORDS 256
+// an address shifted right by this is its page number
+#define DATA_PAGE_SHIFT 8
+
+// one page of a paged data area
+struct DATA_PAGE {
+  uint8_t words[DATA_PAGE_WORDS][WORD_SIZE];
+};
+
+typedef struct DATA_PAGE DataPage;
+
+// what every page reads as until something is stored to it, all 0xFFFF. It
+// is in machine.cpp so there is only one copy.
+extern const DataPage BLANK_DATA_PAGE;
+
+// A data area that is one array of WORDS words, all of it always there.
+template <int WORDS_>
+class DenseData {
+ public:
+  static constexpr int WORDS = WORDS_;
+  // the whole area is a single page
+  static constexpr int PAGE_WORDS = WORDS;
+  static constexpr int PAGES = 1;
+
+  /**
+   * @param address word address, below WORDS
+   * @return the word, big endian
+   */
+  const uint8_t *word(uint16_t address) const { return words_[address]; }
+
+  /**
+   * @param address word address, below WORDS
+   * @return the word to store to, big endian
+   */
+  uint8_t *writable(uint16_t address) { return words_[address]; }
+
+  /**
+   * @param number page number, below PAGES
+   * @return the words of the page, never nullptr
+   */
+  const uint8_t (*page(int number) const)[WORD_SIZE] {
+    return words_ + number * PAGE_WORDS;
+  }
+
+  /**
+   * set every word to 0xFFFF
+   */
+  void clear() { memset(words_, 0xFF, sizeof words_); }
+
+  /**
+   * @return true if both areas hold the same words
+   */
+  bool same(const DenseData &other) const {
+    return memcmp(words_, other.words_, sizeof words_) == 0;
+  }
+
+  /**
+   * copy words in, first + count must be at most WORDS
+   */
+  void write(int first, int count, const uint8_t (*from)[WORD_SIZE]) {
+    memcpy(words_[first], from, count * WORD_SIZE);
+  }
+
+  /**
+   * copy words out, first + count must be at most WORDS
+   */
+  void read(int first, int count, uint8_t (*to)[WORD_SIZE]) const {
+    memcpy(to, words_[first], count * WORD_SIZE);
+  }
+
+  // what the JIT works on, the words themselves
+  uint8_t (*words())[WORD_SIZE] { return words_; }
+  DataPage *const *page_table() const { return nullptr; }
+
+ private:
+  uint8_t words_[WORDS][WORD_SIZE];
+};
+
+// A data area of WORDS words in pages that are allocated on the first store.
+// Copies are deep, so machines still share nothing.
+template <int WORDS_>
+class PagedData {
+ public:
+  static constexpr int WORDS = WORDS_;
+  static constexpr int PAGE_WORDS = DATA_PAGE_WORDS;
+  static constexpr int PAGES = WORDS / DATA_PAGE_WORDS;
+
+  static_assert(WORDS % DATA_PAGE_WORDS == 0,
+                "a paged data area must be whole pages");
+
+  PagedData() : cached_number_(-1), cached_(nullptr) {
+    for (int n = 0; n < PAGES; n++) pages_[n] = blank();
+  }
+
+  PagedData(const PagedData &other) : PagedData() { *this = other; }
+
+  ~PagedData() { clear(); }
+
+  /**
+   * copy the words of another area, reusing the pages this one already has
+   */
+  PagedData &operator=(const PagedData &other) {
+    if (this == &other) return *this;
+    cached_number_ = -1;
+    for (int n = 0; n < PAGES; n++) {
+      if (other.pages_[n] == blank()) {
+        release(n);
+        continue;
+      }
+      if (pages_[n] == blank()) pages_[n] = new DataPage;
+      *pages_[n] = *other.pages_[n];
+    }
+    return *this;
+  }
+
+  /**
+   * @param address word address, below WORDS
+   * @return the word, big endian
+   */
+  const uint8_t *word(uint16_t address) const {
+    return pages_[address >> DATA_PAGE_SHIFT]
+        ->words[address & (DATA_PAGE_WORDS - 1)];
+  }
+
+  /**
+   * the page is allocated if this is the first store to it. The last page
+   * stored to is kept at hand, as stores tend to stay on one page.
+   * @param address word address, below WORDS
+   * @return the word to store to, big endian
+   */
+  uint8_t *writable(uint16_t address) {
+    int number = address >> DATA_PAGE_SHIFT;
+
+    if (number != cached_number_) {
+      if (pages_[number] == blank()) {
+        pages_[number] = new DataPage(BLANK_DATA_PAGE);
+      }
+      cached_number_ = number;
+      cached_ = pages_[number];
+    }
+    return cached_->words[address & (DATA_PAGE_WORDS - 1)];
+  }
+
+  /**
+   * @param number page number, below PAGES
+   * @return the words of the page, or nullptr if nothing was ever stored to
+   *         it and it reads as all 0xFFFF
+   */
+  const uint8_t (*page(int number) const)[WORD_SIZE] {
+    return pages_[number] == blank() ? nullptr : pages_[number]->words;
+  }
+
+  /**
+   * set every word to 0xFFFF, which gives back all the pages
+   */
+  void clear() {
+    cached_number_ = -1;
+    for (int n = 0; n < PAGES; n++) release(n);
+  }
+
+  /**
+   * @return true if both areas hold the same words
+   */
+  bool same(const PagedData &other) const {
+    for (int n = 0; n < PAGES; n++) {
+      // a page that is blank in both is the same pointer
+      if (pages_[n] != other.pages_[n] &&
+          memcmp(pages_[n], other.pages_[n], sizeof(DataPage)) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * copy words in, first + count must be at most WORDS
+   */
+  void write(int first, int count, const uint8_t (*from)[WORD_SIZE]) {
+    while (count > 0) {
+      int part = DATA_PAGE_WORDS - (first & (DATA_PAGE_WORDS - 1));
+
+      if (part > count) part = count;
+      memcpy(writable(first), from, part * WORD_SIZE);
+      first += part;
+      from += part;
+      count -= part;
+    }
+  }
+
+  /**
+   * copy words out, first + count must be at most WORDS
+   */
+  void read(int first, int count, uint8_t (*to)[WORD_SIZE]) const {
+    while (count > 0) {
+      int part = DATA_PAGE_WORDS - (first & (DATA_PAGE_WORDS - 1));
+
+      if (part > count) part = count;
+      memcpy(to, word(first), part * WORD_SIZE);
+      first += part;
+      to += part;
+      count -= part;
+    }
+  }
+
+  // what the JIT works on, the page table with the blank page standing in
+  // for pages that aren't there
+  uint8_t (*words())[WORD_SIZE] { return nullptr; }
+  DataPage *const *page_table() const { return pages_; }
+
+ private:
+  // never written through, writable() swaps in a page of its own first
+  static DataPage *blank() { return const_cast<DataPage *>(&BLANK_DATA_PAGE); }
+
+  void release(int number) {
+    if (pages_[number] == blank()) return;
+    delete pages_[number];
+    pages_[number] = blank();
+  }
+
+  DataPage *pages_[PAGES];
+  int cached_number_;  // the page writable() used last, -1 for none
+  DataPage *cached_;
+};
+
+// the data area a geometry asks for
+template <class G>
+using DataAreaFor =
+    typename std::conditional<G::PAGED_DATA, PagedData<G::DATA_WORDS>,
+                              DenseData<G::DATA_WORDS>>::type;
+
+#endif  // DATA_AREA_H_
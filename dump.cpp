@@ -0,0 +1,119 @@
+#include "dump.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+// what a byte turns into in the hex and ASCII columns, worked out once
+struct DUMP_TABLES {
+  char hex[256][3];  // two digits and a space
+  char ascii[256];   // itself if printable, '.' if not
+
+  DUMP_TABLES() {
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < 256; i++) {
+      hex[i][0] = digits[i >> 4];
+      hex[i][1] = digits[i & 0xF];
+      hex[i][2] = ' ';
+      ascii[i] = i < 0x21 || i > 0x7e ? '.' : (char)i;
+    }
+  }
+};
+
+typedef struct DUMP_TABLES DumpTables;
+
+static const DumpTables tables;
+
+void format_dump(const uint8_t *bytes, size_t length, size_t base,
+                 DumpFormat format, std::string &out) {
+  size_t lines = (length + DUMP_LINE_BYTES - 1) / DUMP_LINE_BYTES;
+  size_t start = out.size();
+  char *c;
+
+  if (format == RAW_DUMP) {
+    out.append(reinterpret_cast<const char *>(bytes), length);
+    return;
+  }
+
+  out.resize(start + lines * DUMP_LINE_SIZE);
+  c = &out[start];
+  for (size_t offset = 0; offset < length; offset += DUMP_LINE_BYTES) {
+    char *text = c + 10 + DUMP_LINE_BYTES * 3 + 2;
+
+    if (format == SPARSE_DUMP && offset + DUMP_LINE_BYTES <= length) {
+      size_t i = offset;
+
+      while (i < offset + DUMP_LINE_BYTES && bytes[i] == 0xFF) i++;
+      if (i == offset + DUMP_LINE_BYTES) continue;
+    }
+
+    for (int i = 7; i >= 0; i--) {
+      *c++ = tables.hex[(base + offset) >> (i * 4) & 0xF][1];
+    }
+    *c++ = ' ';
+    *c++ = ' ';
+    for (size_t i = offset; i < offset + DUMP_LINE_BYTES; i++) {
+      // past the end of the memory the line is filled out with ff
+      uint8_t byte = i < length ? bytes[i] : 0xFF;
+
+      *c++ = tables.hex[byte][0];
+      *c++ = tables.hex[byte][1];
+      *c++ = tables.hex[byte][2];
+      *text++ = tables.ascii[byte];
+    }
+    *c++ = ' ';
+    *c++ = '|';
+    c += DUMP_LINE_BYTES;
+    *c++ = '|';
+    *c++ = '\n';
+  }
+  out.resize(c - out.data());
+}
+
+void format_diff(const uint8_t (*words)[2], const uint8_t (*original)[2],
+                 const uint64_t *stored, size_t count, size_t first,
+                 std::string &out) {
+  for (size_t block = 0; block < (count + 63) / 64; block++) {
+    // only the words that were stored to need a look
+    for (uint64_t bits = stored[block]; bits; bits &= bits - 1) {
+      size_t i = block * 64 + __builtin_ctzll(bits);
+      size_t address = first + i;
+      char line[10];
+
+      if (i >= count || memcmp(words[i], original[i], 2) == 0) continue;
+      line[0] = tables.hex[address >> 8 & 0xFF][0];
+      line[1] = tables.hex[address >> 8 & 0xFF][1];
+      line[2] = tables.hex[address & 0xFF][0];
+      line[3] = tables.hex[address & 0xFF][1];
+      line[4] = '=';
+      line[5] = tables.hex[words[i][0]][0];
+      line[6] = tables.hex[words[i][0]][1];
+      line[7] = tables.hex[words[i][1]][0];
+      line[8] = tables.hex[words[i][1]][1];
+      line[9] = '\n';
+      out.append(line, sizeof line);
+    }
+  }
+}
+
+bool write_all(int fd, const char *buffer, size_t size) {
+  while (size > 0) {
+#if !defined(_WIN32)
+    ssize_t written = write(fd, buffer, size);
+#else
+    int written = _write(fd, buffer, (unsigned)size);
+#endif
+
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    buffer += written;
+    size -= written;
+  }
+  return true;
+}
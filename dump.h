@@ -0,0 +1,63 @@
+// Memory dumps, as the simulator prints the data area and the assembler the
+// code it generated. The hex form is the classic offset, hex bytes and ASCII
+// column, 16 bytes to a line; the sparse form is the same without the lines
+// that are all ff; the raw form is the bytes themselves. The diff form lists
+// only the words a run changed. Each is built in one buffer so it can go out
+// with a single write.
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// bytes shown on one line of the hex form
+#define DUMP_LINE_BYTES 16
+// characters in one line of the hex form, newline included
+#define DUMP_LINE_SIZE (10 + DUMP_LINE_BYTES * 3 + 2 + DUMP_LINE_BYTES + 2)
+
+// the ways a dump can be written, selected with --dump
+enum DUMP_FORMATS {
+  HEX_DUMP,     // offset, hex and ASCII lines
+  RAW_DUMP,     // the bytes as they are
+  DIFF_DUMP,    // address=word for every word that changed
+  SPARSE_DUMP,  // hex lines that aren't all ff
+  NUM_DUMP_FORMATS
+};
+
+typedef enum DUMP_FORMATS DumpFormat;
+
+/**
+ * append a dump of a block of memory. In the hex form the last line is
+ * filled out with ff bytes, the illegal instruction.
+ * @param bytes the memory
+ * @param length its size in bytes
+ * @param base the offset shown for bytes[0], a multiple of DUMP_LINE_BYTES
+ * @param format how to dump it, anything but DIFF_DUMP
+ * @param out where the dump goes
+ */
+void format_dump(const uint8_t *bytes, size_t length, size_t base,
+                 DumpFormat format, std::string &out);
+
+/**
+ * append an address=word line, both in hex, for every big endian word that
+ * is marked as stored to and differs from the original
+ * @param words the memory
+ * @param original what it held before
+ * @param stored a bit for every word that may have changed
+ * @param count number of words
+ * @param first the address shown for words[0]
+ * @param out where the dump goes
+ */
+void format_diff(const uint8_t (*words)[2], const uint8_t (*original)[2],
+                 const uint64_t *stored, size_t count, size_t first,
+                 std::string &out);
+
+/**
+ * write a whole buffer to a file descriptor, in one write where the system
+ * takes it
+ * @return false if the write failed
+ */
+bool write_all(int fd, const char *buffer, size_t size);
+
+#endif  // DUMP_H_
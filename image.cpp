@@ -0,0 +1,248 @@
+#include "image.h"
+
+#include <cstdio>
+#include <cstring>
+
+// Hex is decoded 32 characters (16 bytes, 8 words) at a time. There are
+// SSSE3 and AVX2 versions for x86-64 hosts, picked by what the CPU supports,
+// and a plain one for everything else. A decoder only says whether the whole
+// block was valid; finding the bad character is left to the plain code.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HEX_SIMD 1
+#include <immintrin.h>
+#else
+#define HEX_SIMD 0
+#endif
+
+// characters of hex decoded at a time
+#define HEX_BLOCK 32
+// words on one line of the text form
+#define TEXT_WORDS_PER_LINE 8
+
+bool is_data_image(const uint8_t *bytes, size_t size) {
+  return size >= sizeof(ImageHeader) &&
+         memcmp(bytes, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) == 0;
+}
+
+bool read_data_image(const uint8_t *bytes, size_t size,
+                     uint8_t (*data)[WORD_SIZE], int capacity, int &words) {
+  ImageHeader header;
+  uint32_t count;
+
+  if (!is_data_image(bytes, size)) return false;
+  memcpy(&header, bytes, sizeof header);
+  count = header.words[0] | header.words[1] << 8 | header.words[2] << 16 |
+          (uint32_t)header.words[3] << 24;
+  if (header.version != IMAGE_VERSION || header.word_size != WORD_SIZE ||
+      (header.byte_order != IMAGE_BIG_ENDIAN &&
+       header.byte_order != IMAGE_LITTLE_ENDIAN) ||
+      count > (size - sizeof header) / WORD_SIZE) {
+    return false;
+  }
+
+  // anything past the end of the data area is dropped, like the text form
+  words = count < (uint32_t)capacity ? count : capacity;
+  memcpy(data, bytes + sizeof header, words * WORD_SIZE);
+  if (header.byte_order == IMAGE_LITTLE_ENDIAN) {
+    for (int i = 0; i < words; i++) {
+      uint8_t low = data[i][0];
+
+      data[i][0] = data[i][1];
+      data[i][1] = low;
+    }
+  }
+  return true;
+}
+
+bool write_data_image(const char *filename, const uint8_t (*data)[WORD_SIZE],
+                      int words) {
+  ImageHeader header = {};
+  FILE *image = fopen(filename, "wb");
+  bool rc;
+
+  if (!image) return false;
+  memcpy(header.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+  header.version = IMAGE_VERSION;
+  header.byte_order = IMAGE_BIG_ENDIAN;
+  header.word_size = WORD_SIZE;
+  for (int i = 0; i < 4; i++) header.words[i] = words >> (i * 8) & 0xFF;
+
+  rc = fwrite(&header, sizeof header, 1, image) == 1 &&
+       fwrite(data, WORD_SIZE, words, image) == (size_t)words;
+  return fclose(image) == 0 && rc;
+}
+
+bool write_data_text(const char *filename, const uint8_t (*data)[WORD_SIZE],
+                     int words) {
+  FILE *text = fopen(filename, "w");
+  bool rc = true;
+
+  if (!text) return false;
+  for (int i = 0; i < words; i++) {
+    fprintf(text, "%02X%02X", data[i][0], data[i][1]);
+    // every line ends in a newline, including the last
+    if (i % TEXT_WORDS_PER_LINE == TEXT_WORDS_PER_LINE - 1 || i == words - 1) {
+      fputc('\n', text);
+    }
+  }
+  rc = !ferror(text);
+  return fclose(text) == 0 && rc;
+}
+
+/////////////////////////////////////////////////
+// the text form
+
+typedef bool (*HexDecoder)(const uint8_t *text, uint8_t *bytes);
+
+/**
+ * @return the value of a hex digit, or -1
+ */
+static inline int hex_value(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+static bool decode_hex_plain(const uint8_t *text, uint8_t *bytes) {
+  int valid = 0;
+
+  for (int i = 0; i < HEX_BLOCK; i += 2) {
+    int high = hex_value(text[i]);
+    int low = hex_value(text[i + 1]);
+
+    valid |= high | low;
+    bytes[i / 2] = high << 4 | low;
+  }
+  return valid >= 0;
+}
+
+#if HEX_SIMD
+__attribute__((target("ssse3"))) static bool decode_hex_ssse3(
+    const uint8_t *text, uint8_t *bytes) {
+  // the high digit of every pair times 16 plus the low one
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  int valid = 0xFFFF;
+
+  for (int i = 0; i < HEX_BLOCK; i += 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    // '0' to '9' and 'a' to 'f' in either case, as offsets from the first
+    // character of the range. A byte is in a range if the unsigned offset is
+    // small enough.
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+    __m128i is_digit =
+        _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_alpha =
+        _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    __m128i values = _mm_or_si128(
+        _mm_and_si128(digit, is_digit),
+        _mm_and_si128(_mm_add_epi8(alpha, _mm_set1_epi8(10)), is_alpha));
+
+    valid &= _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+    values = _mm_maddubs_epi16(values, weights);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(bytes + i / 2),
+                     _mm_packus_epi16(values, values));
+  }
+  return valid == 0xFFFF;
+}
+
+__attribute__((target("avx2"))) static bool decode_hex_avx2(
+    const uint8_t *text, uint8_t *bytes) {
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text));
+  // as in decode_hex_ssse3()
+  __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+                                  _mm256_set1_epi8('a'));
+  __m256i is_digit =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  __m256i is_alpha =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+  __m256i values = _mm256_or_si256(
+      _mm256_and_si256(digit, is_digit),
+      _mm256_and_si256(_mm256_add_epi8(alpha, _mm256_set1_epi8(10)), is_alpha));
+
+  values = _mm256_maddubs_epi16(values, weights);
+  // packing works within each 128 bit half, gather the two results
+  values = _mm256_permute4x64_epi64(_mm256_packus_epi16(values, values),
+                                    0b1000);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes),
+                   _mm256_castsi256_si128(values));
+  return _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) == -1;
+}
+#endif
+
+/**
+ * @return the fastest decoder this CPU can run
+ */
+static HexDecoder pick_hex_decoder() {
+#if HEX_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return decode_hex_avx2;
+  if (__builtin_cpu_supports("ssse3")) return decode_hex_ssse3;
+#endif
+  return decode_hex_plain;
+}
+
+bool read_data_text(const uint8_t *text, size_t size,
+                    uint8_t (*data)[WORD_SIZE], int capacity, int &words,
+                    TextError &error) {
+  static const HexDecoder decode = pick_hex_decoder();
+  // where words past the end of the data area are decoded to be checked
+  uint8_t overflow[HEX_BLOCK / 2];
+  const uint8_t *end = text + size;
+  const uint8_t *line = text;
+  int line_number = 0;
+
+  words = 0;
+  while (line < end) {
+    const uint8_t *newline =
+        static_cast<const uint8_t *>(memchr(line, '\n', end - line));
+    const uint8_t *line_end = newline ? newline : end;
+    const uint8_t *c = line;
+
+    line_number++;
+    if (line_end > line && line_end[-1] == '\r') line_end--;
+
+    // whole blocks first, word by word for the rest, for a block that only
+    // partly fits or to find a mistake
+    while (line_end - c >= HEX_BLOCK) {
+      uint8_t *bytes = words + HEX_BLOCK / 4 <= capacity ? data[words]
+                       : words >= capacity               ? overflow
+                                                         : nullptr;
+
+      if (!bytes || !decode(c, bytes)) break;
+      c += HEX_BLOCK;
+      words += HEX_BLOCK / 4;
+    }
+    for (; c < line_end; c += 4) {
+      int value = 0;
+
+      for (int i = 0; i < 4; i++) {
+        int digit = c + i < line_end ? hex_value(c[i]) : -1;
+
+        if (digit < 0) {
+          error.line = line_number;
+          error.column = c + i - line + 1;
+          error.message = c + i < line_end
+                              ? "expected a hex digit"
+                              : "the line ends in the middle of a word";
+          if (words > capacity) words = capacity;
+          return false;
+        }
+        value = value << 4 | digit;
+      }
+      if (words < capacity) {
+        data[words][0] = value >> 8;
+        data[words][1] = value & 0xFF;
+      }
+      words++;
+    }
+    line = newline ? newline + 1 : end;
+  }
+  // anything past the end of the data area is dropped
+  if (words > capacity) words = capacity;
+  return true;
+}
@@ -0,0 +1,90 @@
+// The two forms of a .dat file. The text form is hex words, line after line,
+// that have to be parsed on every load. The binary form is a short header
+// followed by the words exactly as they sit in the data area (big endian), so
+// loading one is a single copy out of a mapped file.
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "isa.h"
+
+// the first bytes of every binary image
+#define IMAGE_MAGIC "S5IM"
+#define IMAGE_MAGIC_SIZE 4
+#define IMAGE_VERSION 1
+
+// byte order of the words that follow the header
+#define IMAGE_BIG_ENDIAN 'B'
+#define IMAGE_LITTLE_ENDIAN 'L'
+
+// The header, all single bytes so it reads the same on every host.
+struct IMAGE_HEADER {
+  char magic[IMAGE_MAGIC_SIZE];  // IMAGE_MAGIC
+  uint8_t version;               // IMAGE_VERSION
+  uint8_t byte_order;            // IMAGE_BIG_ENDIAN or IMAGE_LITTLE_ENDIAN
+  uint8_t word_size;             // bytes per word, WORD_SIZE
+  uint8_t reserved;              // 0
+  uint8_t words[4];              // words after the header, little endian
+};
+
+typedef struct IMAGE_HEADER ImageHeader;
+
+// where the text form is malformed
+struct TEXT_ERROR {
+  int line;             // counting from 1
+  int column;           // counting from 1, in bytes
+  const char *message;  // what is wrong there
+};
+
+typedef struct TEXT_ERROR TextError;
+
+/**
+ * parse the text form into a data area, checking every character. A line
+ * may end in \r\n and the last one needs no line break.
+ * @param text the whole file
+ * @param size its length
+ * @param data the data area, words past the end of the text are left alone
+ * @param capacity words in the data area
+ * @param words set to the number of words stored, anything past the end of
+ *              the data area is checked but dropped
+ * @param error set to the first mistake in the text
+ * @return false if a line holds anything but whole words of hex digits
+ */
+bool read_data_text(const uint8_t *text, size_t size,
+                    uint8_t (*data)[WORD_SIZE], int capacity, int &words,
+                    TextError &error);
+
+/**
+ * @return true if the bytes start like a binary image
+ */
+bool is_data_image(const uint8_t *bytes, size_t size);
+
+/**
+ * copy a binary image into a data area
+ * @param bytes the whole image file
+ * @param size its length
+ * @param data the data area, words past the end of the image are left alone
+ * @param capacity words in the data area, anything past it is dropped
+ * @param words set to the number of words copied
+ * @return false if the header is damaged or doesn't fit this machine
+ */
+bool read_data_image(const uint8_t *bytes, size_t size,
+                     uint8_t (*data)[WORD_SIZE], int capacity, int &words);
+
+/**
+ * write the first words of a data area as a binary image
+ * @return false if the file can't be written
+ */
+bool write_data_image(const char *filename, const uint8_t (*data)[WORD_SIZE],
+                      int words);
+
+/**
+ * write the first words of a data area in the text form
+ * @return false if the file can't be written
+ */
+bool write_data_text(const char *filename, const uint8_t (*data)[WORD_SIZE],
+                     int words);
+
+#endif  // IMAGE_H_
@@ -0,0 +1,4 @@
+#include "isa.h"
+
+// every instruction word decoded, worked out by the compiler, see isa.h
+constexpr DECODE_TABLE DECODE_TABLE_WORDS{};
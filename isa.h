@@ -0,0 +1,217 @@
+// Definitions of the instruction set shared by the simulator's engines: the
+// processor geometry, the opcodes and the decoded form of an instruction.
+#ifndef ISA_H_
+#define ISA_H_
+
+#include <cstdint>
+
+// constants for our processor definition (sizes are in words). The code and
+// data sizes are those of the classic machine, see ClassicGeometry.
+#define WORD_SIZE 2
+#define DATA_SIZE 1024
+#define CODE_SIZE 1024
+#define REGISTERS 16
+// the most words a 16 bit address reaches
+#define MAX_AREA_SIZE 65536
+
+// The sizes of a machine's code and data areas, in words, for the templates
+// that build a simulator around them. The instruction set fixes the word
+// size and the registers; an area can be any power of two up to what an
+// address reaches, and at that size nothing needs to be bounds checked.
+// A paged data area only holds the pages a program stores to (see
+// data_area.h), for address spaces much bigger than what programs use.
+template <int CODE, int DATA, bool PAGED = false>
+struct MachineGeometry {
+  static constexpr int CODE_WORDS = CODE;
+  static constexpr int DATA_WORDS = DATA;
+  static constexpr bool PAGED_DATA = PAGED;
+
+  static_assert(CODE_WORDS > 0 && CODE_WORDS <= MAX_AREA_SIZE &&
+                    (CODE_WORDS & (CODE_WORDS - 1)) == 0,
+                "the code area must be a power of two up to 64K words");
+  static_assert(DATA_WORDS > 0 && DATA_WORDS <= MAX_AREA_SIZE &&
+                    (DATA_WORDS & (DATA_WORDS - 1)) == 0,
+                "the data area must be a power of two up to 64K words");
+};
+
+// the layout the samples are written for, 1K words of each
+typedef MachineGeometry<CODE_SIZE, DATA_SIZE> ClassicGeometry;
+// everything an address can reach, for stress workloads, with paged data
+typedef MachineGeometry<MAX_AREA_SIZE, MAX_AREA_SIZE, true> LargeGeometry;
+
+// our opcodes are nicely incremental
+enum OPCODES {
+  ADD_OPCODE,
+  SUB_OPCODE,
+  AND_OPCODE,
+  OR_OPCODE,
+  XOR_OPCODE,
+  MOVE_OPCODE,
+  SHIFT_OPCODE,
+  BRANCH_OPCODE,
+  NUM_OPCODES
+};
+
+typedef enum OPCODES Opcode;
+
+// Every legal (opcode, type) pair gets its own handler, so once an instruction
+// has been decoded nothing has to look at the raw bits again.
+enum HANDLERS {
+  ADD_LITERAL_HANDLER,
+  ADD_REGISTER_HANDLER,
+  SUB_LITERAL_HANDLER,
+  SUB_REGISTER_HANDLER,
+  AND_LITERAL_HANDLER,
+  AND_REGISTER_HANDLER,
+  OR_LITERAL_HANDLER,
+  OR_REGISTER_HANDLER,
+  XOR_LITERAL_HANDLER,
+  XOR_REGISTER_HANDLER,
+  MOVE_LITERAL_HANDLER,
+  MOVE_LOAD_HANDLER,
+  MOVE_STORE_LITERAL_HANDLER,
+  MOVE_STORE_REGISTER_HANDLER,
+  SHIFT_RIGHT_HANDLER,
+  SHIFT_LEFT_HANDLER,
+  JR_HANDLER,
+  BEQ_HANDLER,
+  BNE_HANDLER,
+  BLT_HANDLER,
+  BGT_HANDLER,
+  BLE_HANDLER,
+  BGE_HANDLER,
+  ILLEGAL_HANDLER,
+  NUM_HANDLERS
+};
+
+typedef enum HANDLERS Handler;
+
+// a code word after decoding. The whole code area is decoded once after
+// loading, and a record is only decoded again after its code word changes.
+struct DECODED_INSTR {
+  uint8_t handler;  // one of HANDLERS
+  uint8_t left;     // left register number
+  uint8_t right;    // right register number (register and memory forms)
+  bool valid;       // cleared when the code word underneath is replaced
+  int16_t literal;  // 6 bit literal/branch offset, already sign extended
+  uint16_t target;  // branch target of the conditional branches
+};
+
+typedef struct DECODED_INSTR DecodedInstr;
+
+/////////////////////////////////////////////////
+// decoding
+
+/**
+ * sign extending for arbitrary digits of integer
+ * @param x number to be extended
+ * @param bits digits
+ * @return extended number
+ */
+constexpr int16_t sign_extend(uint16_t x, int bits) {
+  uint16_t m = 1u << (bits - 1);
+  return (x ^ m) - m;
+}
+
+// everything an instruction word says, whatever the address it is at
+struct DECODE_ENTRY {
+  uint8_t handler;  // one of HANDLERS
+  uint8_t opcode;   // one of OPCODES, even for an illegal word
+  uint8_t left;     // left register number
+  uint8_t right;    // right register number (register and memory forms)
+  int8_t literal;   // 6 bit literal/branch offset, already sign extended
+  bool legal;       // false exactly when the processor stops on it with
+                    // ILLEGAL_OPCODE
+};
+
+typedef struct DECODE_ENTRY DecodeEntry;
+
+// An instruction is 16 bits, so every word there can be is decoded once, by
+// the compiler. The interpreters, the disassembler and the assembler's checks
+// all look words up here rather than pick the bits apart themselves. It is in
+// isa.cpp so there is only one copy.
+struct DECODE_TABLE {
+  DecodeEntry entry[MAX_AREA_SIZE];
+
+  constexpr DECODE_TABLE() : entry() {
+    for (int word = 0; word < MAX_AREA_SIZE; word++) {
+      // ooo ttt ll | ll rrrr xx, with the literal in the low 6 bits
+      int opcode = word >> 13 & 0b111;
+      int type = word >> 10 & 0b111;
+      DecodeEntry &e = entry[word];
+
+      e.handler = ILLEGAL_HANDLER;
+      e.opcode = opcode;
+      e.left = word >> 6 & 0b1111;
+      e.right = word >> 2 & 0b1111;
+      e.literal = sign_extend(word & 0b111111, 6);
+      switch (opcode) {
+        case ADD_OPCODE:
+        case SUB_OPCODE:
+        case AND_OPCODE:
+        case OR_OPCODE:
+        case XOR_OPCODE:
+          // the literal and register handlers alternate in the same order
+          // as the opcodes
+          if (type == 0 || type == 1) {
+            e.handler = ADD_LITERAL_HANDLER + opcode * 2 + type;
+          }
+          break;
+        case MOVE_OPCODE:
+          if (type == 0) {
+            e.handler = MOVE_LITERAL_HANDLER;
+          } else if (type == 1) {
+            e.handler = MOVE_LOAD_HANDLER;
+          } else if (type == 0b100) {
+            e.handler = MOVE_STORE_LITERAL_HANDLER;
+          } else if (type == 0b101) {
+            e.handler = MOVE_STORE_REGISTER_HANDLER;
+          }
+          break;
+        case SHIFT_OPCODE:
+          if (type == 0) {
+            e.handler = SHIFT_RIGHT_HANDLER;
+          } else if (type == 1) {
+            e.handler = SHIFT_LEFT_HANDLER;
+          }
+          break;
+        default:
+          // JR through BGE are numbered like their types, 0b111 is unused
+          if (type < 0b111) {
+            e.handler = JR_HANDLER + type;
+          }
+      }
+      e.legal = e.handler != ILLEGAL_HANDLER;
+    }
+  }
+
+  /**
+   * @param raw an instruction word, big endian
+   */
+  const DecodeEntry &operator[](const uint8_t *raw) const {
+    return entry[raw[0] << 8 | raw[1]];
+  }
+};
+
+extern const DECODE_TABLE DECODE_TABLE_WORDS;
+
+/**
+ * decode a single code word
+ * @param raw the code word, big endian
+ * @param address where the word lives, used for the branch target
+ * @return the decoded instruction
+ */
+inline DecodedInstr decode_word(const uint8_t *raw, uint16_t address) {
+  const DecodeEntry &e = DECODE_TABLE_WORDS[raw];
+  DecodedInstr decoded;
+
+  decoded.handler = e.handler;
+  decoded.left = e.left;
+  decoded.right = e.right;
+  decoded.valid = true;
+  decoded.literal = e.literal;
+  decoded.target = address + e.literal;
+  return decoded;
+}
+
+#endif  // ISA_H_
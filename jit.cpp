@@ -0,0 +1,815 @@
+#include "jit.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#else
+#define JIT_X86_64 0
+#endif
+
+// bytes of executable memory for the trampoline and all compiled blocks
+#define JIT_CACHE_SIZE (4 * 1024 * 1024)
+// longest straight run of instructions compiled into one block
+#define JIT_MAX_BLOCK 256
+// generous bound on the code one instruction turns into, exit stubs included
+#define JIT_MAX_INSTR_BYTES 320
+
+#if JIT_X86_64
+
+// Register use in generated code:
+//   rbx  the JitContext
+//   rbp  context.detector
+//   r12  context.registers
+//   r13  context.data, or context.pages for a paged data area
+//   r14  context.loop_counts
+//   r15  the block table, for JR
+//   rax, rcx, rdx, rsi, rdi, r8  scratch
+// The simulated registers always live in memory, so any exit can simply
+// store the PC and return.
+enum X86_REGISTERS {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+
+// condition codes as used by jcc
+enum X86_CONDITIONS {
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_G = 0xF
+};
+
+// the /digit of the 0x81 and 0xD1 opcode groups. The register to register
+// form of an ALU operation is always digit * 8 + 1.
+enum X86_OPERATIONS {
+  ALU_ADD = 0,
+  ALU_OR = 1,
+  ALU_AND = 4,
+  ALU_SUB = 5,
+  ALU_XOR = 6,
+  ALU_CMP = 7,
+  SHIFT_LEFT = 4,
+  SHIFT_RIGHT = 5
+};
+
+// ALU operation for each arithmetic opcode, ADD_OPCODE through XOR_OPCODE
+static const int ARITHMETIC_OPERATIONS[] = {ALU_ADD, ALU_SUB, ALU_AND, ALU_OR,
+                                            ALU_XOR};
+
+// writes x86-64 instructions one after the other, only the handful of forms
+// the compiler needs
+struct Emitter {
+  uint8_t *p;
+
+  void byte(uint8_t b) { *p++ = b; }
+
+  void u16(uint16_t v) {
+    memcpy(p, &v, sizeof v);
+    p += sizeof v;
+  }
+
+  void u32(uint32_t v) {
+    memcpy(p, &v, sizeof v);
+    p += sizeof v;
+  }
+
+  // REX prefix, left out when none of its bits are needed
+  void rex(bool wide, int reg, int index, int base) {
+    uint8_t prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | (index >> 3) << 1 |
+                     base >> 3;
+    if (prefix != 0x40) byte(prefix);
+  }
+
+  // ModRM for a register operand
+  void direct(int reg, int rm) { byte(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+
+  // ModRM (and SIB) for [base + disp32]
+  void memory(int reg, int base, int32_t disp) {
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) byte(0x24);
+    u32(disp);
+  }
+
+  // ModRM, SIB and a zero disp8 for [base + index << scale]. The
+  // displacement keeps r13 usable as a base.
+  void indexed(int reg, int base, int index, int scale) {
+    byte(0x44 | (reg & 7) << 3);
+    byte(scale << 6 | (index & 7) << 3 | (base & 7));
+    byte(0);
+  }
+
+  // movzx dst32, word [base + disp]
+  void load16(int dst, int base, int32_t disp) {
+    rex(false, dst, 0, base);
+    byte(0x0F);
+    byte(0xB7);
+    memory(dst, base, disp);
+  }
+
+  // mov word [base + disp], src16
+  void store16(int base, int32_t disp, int src) {
+    byte(0x66);
+    rex(false, src, 0, base);
+    byte(0x89);
+    memory(src, base, disp);
+  }
+
+  // mov word [base + disp], imm16
+  void store16_imm(int base, int32_t disp, uint16_t imm) {
+    byte(0x66);
+    rex(false, 0, 0, base);
+    byte(0xC7);
+    memory(0, base, disp);
+    u16(imm);
+  }
+
+  // mov dst32, dword [base + disp]
+  void load32(int dst, int base, int32_t disp) {
+    rex(false, dst, 0, base);
+    byte(0x8B);
+    memory(dst, base, disp);
+  }
+
+  // mov dword [base + disp], src32
+  void store32(int base, int32_t disp, int src) {
+    rex(false, src, 0, base);
+    byte(0x89);
+    memory(src, base, disp);
+  }
+
+  // mov dst64, qword [base + disp]
+  void load64(int dst, int base, int32_t disp) {
+    rex(true, dst, 0, base);
+    byte(0x8B);
+    memory(dst, base, disp);
+  }
+
+  // movzx dst32, word [base + index * 2]
+  void load16_indexed(int dst, int base, int index) {
+    rex(false, dst, index, base);
+    byte(0x0F);
+    byte(0xB7);
+    indexed(dst, base, index, 1);
+  }
+
+  // mov word [base + index * 2], src16
+  void store16_indexed(int base, int index, int src) {
+    byte(0x66);
+    rex(false, src, index, base);
+    byte(0x89);
+    indexed(src, base, index, 1);
+  }
+
+  // mov dst64, qword [base + index * 8]
+  void load64_indexed(int dst, int base, int index) {
+    rex(true, dst, index, base);
+    byte(0x8B);
+    indexed(dst, base, index, 3);
+  }
+
+  // mov dst32, imm32
+  void move_imm(int dst, uint32_t imm) {
+    rex(false, 0, 0, dst);
+    byte(0xB8 + (dst & 7));
+    u32(imm);
+  }
+
+  // mov dst64, imm64
+  void move_imm64(int dst, uint64_t imm) {
+    rex(true, 0, 0, dst);
+    byte(0xB8 + (dst & 7));
+    u32((uint32_t)imm);
+    u32((uint32_t)(imm >> 32));
+  }
+
+  // movsxd dst64, src32
+  void sign_extend32(int dst, int src) {
+    rex(true, dst, 0, src);
+    byte(0x63);
+    direct(dst, src);
+  }
+
+  // imul dst64, qword [base + index * 8]
+  void multiply_indexed64(int dst, int base, int index) {
+    rex(true, dst, index, base);
+    byte(0x0F);
+    byte(0xAF);
+    indexed(dst, base, index, 3);
+  }
+
+  // add qword [base + disp], src64
+  void add_memory64(int base, int32_t disp, int src) {
+    rex(true, src, 0, base);
+    byte(0x01);
+    memory(src, base, disp);
+  }
+
+  // inc dword [base + disp]
+  void increment32(int base, int32_t disp) {
+    rex(false, 0, 0, base);
+    byte(0xFF);
+    memory(0, base, disp);
+  }
+
+  // bts qword [base + disp], index64
+  void bit_set_memory(int base, int32_t disp, int index) {
+    rex(true, index, 0, base);
+    byte(0x0F);
+    byte(0xAB);
+    memory(index, base, disp);
+  }
+
+  // cmp word [base + disp], imm16
+  void compare16_imm(int base, int32_t disp, uint16_t imm) {
+    byte(0x66);
+    rex(false, 0, 0, base);
+    byte(0x81);
+    memory(ALU_CMP, base, disp);
+    u16(imm);
+  }
+
+  // cmp dword [base + disp], imm32
+  void compare32_imm(int base, int32_t disp, uint32_t imm) {
+    rex(false, 0, 0, base);
+    byte(0x81);
+    memory(ALU_CMP, base, disp);
+    u32(imm);
+  }
+
+  // cmp dword [base + disp], src32
+  void compare32(int base, int32_t disp, int src) {
+    rex(false, src, 0, base);
+    byte(0x39);
+    memory(src, base, disp);
+  }
+
+  // cmp src64, qword [base + disp]
+  void compare64(int src, int base, int32_t disp) {
+    rex(true, src, 0, base);
+    byte(0x3B);
+    memory(src, base, disp);
+  }
+
+  // cmp a64, b64
+  void compare64_registers(int a, int b) {
+    rex(true, b, 0, a);
+    byte(0x39);
+    direct(b, a);
+  }
+
+  // dec dword [base + disp]
+  void decrement32(int base, int32_t disp) {
+    rex(false, 0, 0, base);
+    byte(0xFF);
+    memory(1, base, disp);
+  }
+
+  // mov dst32, src32
+  void move32(int dst, int src) {
+    rex(false, src, 0, dst);
+    byte(0x89);
+    direct(src, dst);
+  }
+
+  // mov dst64, src64
+  void move64(int dst, int src) {
+    rex(true, src, 0, dst);
+    byte(0x89);
+    direct(src, dst);
+  }
+
+  // <operation> dst32, src32
+  void alu(int operation, int dst, int src) {
+    rex(false, src, 0, dst);
+    byte(operation * 8 + 1);
+    direct(src, dst);
+  }
+
+  // <operation> dst32, imm32
+  void alu_imm(int operation, int dst, uint32_t imm) {
+    rex(false, 0, 0, dst);
+    byte(0x81);
+    direct(operation, dst);
+    u32(imm);
+  }
+
+  // shl/shr dst32, 1
+  void shift1(int operation, int dst) {
+    rex(false, 0, 0, dst);
+    byte(0xD1);
+    direct(operation, dst);
+  }
+
+  // shl/shr dst32, imm8
+  void shift_imm(int operation, int dst, uint8_t imm) {
+    rex(false, 0, 0, dst);
+    byte(0xC1);
+    direct(operation, dst);
+    byte(imm);
+  }
+
+  // rol dst16, 8, swapping between our big endian words and the host
+  void swap_bytes16(int dst) {
+    byte(0x66);
+    rex(false, 0, 0, dst);
+    byte(0xC1);
+    direct(0, dst);
+    byte(8);
+  }
+
+  // test a64, b64
+  void test64(int a, int b) {
+    rex(true, b, 0, a);
+    byte(0x85);
+    direct(b, a);
+  }
+
+  // jcc rel32, the returned displacement is filled in with patch()
+  uint8_t *jcc(int condition) {
+    byte(0x0F);
+    byte(0x80 + condition);
+    u32(0);
+    return p - 4;
+  }
+
+  // jmp rel32, the returned displacement is filled in with patch()
+  uint8_t *jmp() {
+    byte(0xE9);
+    u32(0);
+    return p - 4;
+  }
+
+  // jmp reg64
+  void jump_register(int reg) {
+    rex(false, 0, 0, reg);
+    byte(0xFF);
+    direct(4, reg);
+  }
+
+  void push(int reg) {
+    rex(false, 0, 0, reg);
+    byte(0x50 + (reg & 7));
+  }
+
+  void pop(int reg) {
+    rex(false, 0, 0, reg);
+    byte(0x58 + (reg & 7));
+  }
+
+  void ret() { byte(0xC3); }
+
+  // the 6 bit sign extension the interpreter applies to register and memory
+  // operands: subtract 64 when bit 5 is set. Clobbers scratch.
+  void sign_extend6(int reg, int scratch) {
+    move32(scratch, reg);
+    alu_imm(ALU_AND, scratch, 0x20);
+    alu(ALU_ADD, scratch, scratch);
+    alu(ALU_SUB, reg, scratch);
+  }
+
+  // point a rel32 at target
+  static void patch(uint8_t *displacement, const uint8_t *target) {
+    int32_t rel = (int32_t)(target - (displacement + 4));
+    memcpy(displacement, &rel, sizeof rel);
+  }
+};
+
+// The generated code reaches into the loop detector with the offsets of the
+// classic machine's, which hold for every size since everything that depends
+// on the size comes last.
+static_assert(offsetof(BasicLoopDetector<PagedData<MAX_AREA_SIZE>>, stored) ==
+                  offsetof(LoopDetector, stored),
+              "loop detector layout depends on the data area size");
+
+// signature of the trampoline at the start of the cache
+typedef JitExit (*Trampoline)(JitContext *, JitBlock, const JitBlock *);
+
+Jit::Jit(const DecodedInstr *program, int code_size, int data_size,
+         bool paged_data, int32_t loop_threshold)
+    : program_(program),
+      code_size_(code_size),
+      data_size_(data_size),
+      paged_data_(paged_data),
+      loop_threshold_(loop_threshold),
+      memory_(nullptr),
+      used_(0),
+      epilogue_(nullptr),
+      blocks_(code_size),
+      pending_(code_size) {
+  void *memory;
+
+  memory = mmap(nullptr, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return;
+  memory_ = static_cast<uint8_t *>(memory);
+  emit_trampoline();
+  // hosts that refuse executable pages just don't get a JIT
+  if (mprotect(memory_, JIT_CACHE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory_, JIT_CACHE_SIZE);
+    memory_ = nullptr;
+  }
+}
+
+Jit::~Jit() {
+  if (memory_) munmap(memory_, JIT_CACHE_SIZE);
+}
+
+void Jit::set_writable(bool writable) {
+  mprotect(memory_, JIT_CACHE_SIZE,
+           writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+}
+
+/**
+ * the entry trampoline loads the fixed registers and jumps into a block, the
+ * epilogue after it is where every exit ends up
+ */
+void Jit::emit_trampoline() {
+  Emitter e = {memory_};
+
+  e.push(RBX);
+  e.push(RBP);
+  e.push(R12);
+  e.push(R13);
+  e.push(R14);
+  e.push(R15);
+  e.move64(RBX, RDI);
+  e.load64(RBP, RBX, offsetof(JitContext, detector));
+  e.load64(R12, RBX, offsetof(JitContext, registers));
+  e.load64(R13, RBX,
+           paged_data_ ? offsetof(JitContext, pages)
+                       : offsetof(JitContext, data));
+  e.load64(R14, RBX, offsetof(JitContext, loop_counts));
+  e.move64(R15, RDX);
+  e.jump_register(RSI);
+
+  epilogue_ = e.p;
+  e.pop(R15);
+  e.pop(R14);
+  e.pop(R13);
+  e.pop(R12);
+  e.pop(RBP);
+  e.pop(RBX);
+  e.ret();
+  used_ = e.p - memory_;
+}
+
+JitBlock Jit::compile(uint16_t pc) {
+  // jumps to exit stubs, emitted after the body of the block
+  struct Stub {
+    uint8_t *jump;
+    uint16_t pc;
+    JitExit reason;
+  };
+  std::vector<Stub> stubs;
+  Emitter e;
+  JitBlock entry;
+  uint16_t p;
+  bool ended = false;
+
+  if (!memory_ || pc >= code_size_) return nullptr;
+  if (blocks_[pc]) return blocks_[pc];
+  // the interpreter reports illegal instructions
+  if (program_[pc].handler == ILLEGAL_HANDLER) return nullptr;
+  if (JIT_CACHE_SIZE - used_ < (JIT_MAX_BLOCK + 1) * JIT_MAX_INSTR_BYTES)
+    return nullptr;
+
+  set_writable(true);
+  e.p = memory_ + used_;
+  entry = e.p;
+  // registered up front so a block can branch to itself
+  blocks_[pc] = entry;
+
+  // leave the block for target: straight into its block if there is one,
+  // otherwise back to the dispatcher through a site that gets patched into a
+  // direct jump once the target is compiled
+  auto exit_to = [&](uint16_t target) {
+    if (target < code_size_ && blocks_[target]) {
+      Emitter::patch(e.jmp(), blocks_[target]);
+      return;
+    }
+    if (target < code_size_) pending_[target].push_back(e.p);
+    e.store16_imm(RBX, offsetof(JitContext, pc), target);
+    e.move_imm(RAX, JIT_CONTINUE);
+    Emitter::patch(e.jmp(), epilogue_);
+  };
+
+  // the loop detector's check of a branch target, either a constant or in
+  // eax (zero extended, so it never matches LOOP_DETECTOR_NO_PC). The PC,
+  // data hash and registers are compared here and a state that matches the
+  // snapshot is handed to the dispatcher to confirm against the data area,
+  // like a snapshot that is due. Returns the jumps for those two.
+  auto check_loop = [&](uint16_t target, bool dynamic, uint8_t **matched,
+                        uint8_t **snapshot) {
+    uint8_t *differs[2 + REGISTERS / 4];
+    int count = 0;
+
+    if (dynamic) {
+      e.compare32(RBP, offsetof(LoopDetector, saved_pc), RAX);
+    } else {
+      e.compare32_imm(RBP, offsetof(LoopDetector, saved_pc), target);
+    }
+    differs[count++] = e.jcc(CC_NE);
+    e.load64(RDX, RBP, offsetof(LoopDetector, data_hash));
+    e.compare64(RDX, RBP, offsetof(LoopDetector, saved_data_hash));
+    differs[count++] = e.jcc(CC_NE);
+    for (int i = 0; i < REGISTERS / 4; i++) {
+      e.load64(RDX, R12, i * 8);
+      e.compare64(RDX, RBP, offsetof(LoopDetector, saved_registers) + i * 8);
+      differs[count++] = e.jcc(CC_NE);
+    }
+    *matched = e.jmp();
+    for (int i = 0; i < count; i++) Emitter::patch(differs[i], e.p);
+    e.decrement32(RBP, offsetof(LoopDetector, countdown));
+    *snapshot = e.jcc(CC_E);
+  };
+
+  // whether the run has been asked to pause, for a jump if it has
+  auto check_pause = [&]() {
+    e.load64(RDX, RBX, offsetof(JitContext, pause));
+    e.compare16_imm(RDX, 0, 0);
+    return e.jcc(CC_NE);
+  };
+
+  // a taken branch to target, checked by the loop detector on the way. A
+  // paused run carries on from there.
+  auto branch_to = [&](uint16_t target) {
+    uint8_t *matched;
+    uint8_t *snapshot;
+
+    if (target < code_size_) {
+      check_loop(target, false, &matched, &snapshot);
+      stubs.push_back({matched, target, JIT_CHECK_LOOP});
+      stubs.push_back({snapshot, target, JIT_LOOP_SNAPSHOT});
+      stubs.push_back({check_pause(), target, JIT_PAUSE});
+    }
+    exit_to(target);
+  };
+
+  // count the branch at p as taken
+  auto count_taken = [&]() {
+    e.load64(RDX, RBX, offsetof(JitContext, taken_counts));
+    e.increment32(RDX, p * sizeof(int32_t));
+  };
+
+  // a paged data area's page for the address in cx into rdi, and the index
+  // of the word in it into r8. A store to a page that is still the blank
+  // one goes to a stub, for the interpreter to make the page.
+  auto find_page = [&](bool store) {
+    e.move32(RDI, RCX);
+    e.shift_imm(SHIFT_RIGHT, RDI, DATA_PAGE_SHIFT);
+    e.load64_indexed(RDI, R13, RDI);
+    if (store) {
+      e.move_imm64(RDX, (uint64_t)&BLANK_DATA_PAGE);
+      e.compare64_registers(RDI, RDX);
+      stubs.push_back({e.jcc(CC_E), p, JIT_NEW_PAGE});
+    }
+    e.move32(R8, RCX);
+    e.alu_imm(ALU_AND, R8, DATA_PAGE_WORDS - 1);
+  };
+
+  // store the word in eax at the address in ecx (already checked), keeping
+  // the detector's data hash and stored bitmap in step
+  auto store = [&]() {
+    int base = R13;
+    int index = RCX;
+
+    if (paged_data_) {
+      find_page(true);
+      base = RDI;
+      index = R8;
+    }
+    e.alu_imm(ALU_AND, RAX, 0xFFFF);
+    e.load16_indexed(RDX, base, index);
+    e.swap_bytes16(RDX);
+    e.move32(RSI, RAX);
+    e.alu(ALU_SUB, RSI, RDX);
+    e.sign_extend32(RSI, RSI);
+    e.move_imm64(RDX, (uint64_t)LOOP_HASH_KEYS_TABLE.key);
+    e.multiply_indexed64(RSI, RDX, RCX);
+    e.add_memory64(RBP, offsetof(LoopDetector, data_hash), RSI);
+    e.bit_set_memory(RBP, offsetof(LoopDetector, stored), RCX);
+    e.swap_bytes16(RAX);
+    e.store16_indexed(base, index, RAX);
+  };
+
+  // the address of a data access in cx, a stub for one past the end of the
+  // data area unless every address is in it
+  auto check_address = [&]() {
+    if (data_size_ > 0xFFFF) return;
+    e.alu_imm(ALU_CMP, RCX, data_size_);
+    stubs.push_back({e.jcc(CC_AE), p, JIT_ILLEGAL_ADDRESS});
+  };
+
+  // a block can run on past the last address and round to 0, as the PC does
+  for (p = pc; !ended; p++) {
+    if (p >= code_size_ || program_[p].handler == ILLEGAL_HANDLER ||
+        (uint16_t)(p - pc) == JIT_MAX_BLOCK) {
+      exit_to(p);
+      break;
+    }
+
+    const DecodedInstr &d = program_[p];
+    int32_t left = d.left * sizeof(uint16_t);
+    int32_t right = d.right * sizeof(uint16_t);
+
+    // the same per-PC accounting as the interpreter
+    e.load32(RDX, R14, p * sizeof(int32_t));
+    e.alu_imm(ALU_ADD, RDX, 1);
+    e.store32(R14, p * sizeof(int32_t), RDX);
+    e.alu_imm(ALU_CMP, RDX, loop_threshold_);
+    stubs.push_back({e.jcc(CC_G), p, JIT_INFINITE_LOOP});
+
+    // registers are combined in 32 bits and stored back as 16, which gives
+    // the same wraparound as uint16_t arithmetic
+    switch (d.handler) {
+      case ADD_LITERAL_HANDLER:
+      case SUB_LITERAL_HANDLER:
+      case AND_LITERAL_HANDLER:
+      case OR_LITERAL_HANDLER:
+      case XOR_LITERAL_HANDLER:
+        e.load16(RAX, R12, left);
+        e.alu_imm(ARITHMETIC_OPERATIONS[(d.handler - ADD_LITERAL_HANDLER) / 2],
+                  RAX, (uint32_t)(int32_t)d.literal);
+        e.store16(R12, left, RAX);
+        break;
+      case ADD_REGISTER_HANDLER:
+      case SUB_REGISTER_HANDLER:
+      case AND_REGISTER_HANDLER:
+      case OR_REGISTER_HANDLER:
+      case XOR_REGISTER_HANDLER:
+        e.load16(RAX, R12, left);
+        e.load16(RCX, R12, right);
+        e.sign_extend6(RCX, RDX);
+        e.alu(ARITHMETIC_OPERATIONS[(d.handler - ADD_LITERAL_HANDLER) / 2],
+              RAX, RCX);
+        e.store16(R12, left, RAX);
+        break;
+      case MOVE_LITERAL_HANDLER:
+        e.move_imm(RAX, (uint32_t)(int32_t)d.literal);
+        e.store16(R12, left, RAX);
+        break;
+      case MOVE_LOAD_HANDLER:
+        e.load16(RCX, R12, right);
+        check_address();
+        if (paged_data_) {
+          find_page(false);
+          e.load16_indexed(RAX, RDI, R8);
+        } else {
+          e.load16_indexed(RAX, R13, RCX);
+        }
+        e.swap_bytes16(RAX);
+        // only 15 bits survive the interpreter's load
+        e.alu_imm(ALU_AND, RAX, 0x7FFF);
+        e.sign_extend6(RAX, RDX);
+        e.store16(R12, left, RAX);
+        break;
+      case MOVE_STORE_LITERAL_HANDLER:
+        e.load16(RCX, R12, left);
+        check_address();
+        e.move_imm(RAX, (uint16_t)d.literal);
+        store();
+        break;
+      case MOVE_STORE_REGISTER_HANDLER:
+        e.load16(RCX, R12, left);
+        check_address();
+        e.load16(RAX, R12, right);
+        e.sign_extend6(RAX, RDX);
+        store();
+        break;
+      case SHIFT_RIGHT_HANDLER:
+      case SHIFT_LEFT_HANDLER:
+        e.load16(RAX, R12, left);
+        e.shift1(d.handler == SHIFT_RIGHT_HANDLER ? SHIFT_RIGHT : SHIFT_LEFT,
+                 RAX);
+        e.store16(R12, left, RAX);
+        break;
+      case JR_HANDLER: {
+        uint8_t *out_of_code = nullptr;
+        uint8_t *matched;
+        uint8_t *loop_snapshot;
+        uint8_t *paused;
+        uint8_t *not_compiled;
+        // leave with the target in ax
+        auto dynamic_exit = [&](JitExit reason) {
+          e.store16(RBX, offsetof(JitContext, pc), RAX);
+          e.move_imm(RAX, reason);
+          Emitter::patch(e.jmp(), epilogue_);
+        };
+
+        // check the target like branch_to(), then look it up in the block
+        // table and go straight there
+        count_taken();
+        e.load16(RAX, R12, left);
+        e.alu_imm(ALU_SUB, RAX, 1);
+        e.alu_imm(ALU_AND, RAX, 0xFFFF);
+        if (code_size_ <= 0xFFFF) {
+          e.alu_imm(ALU_CMP, RAX, code_size_);
+          out_of_code = e.jcc(CC_AE);
+        }
+        check_loop(0, true, &matched, &loop_snapshot);
+        paused = check_pause();
+        e.load64_indexed(RDX, R15, RAX);
+        e.test64(RDX, RDX);
+        not_compiled = e.jcc(CC_E);
+        e.jump_register(RDX);
+        if (out_of_code) Emitter::patch(out_of_code, e.p);
+        Emitter::patch(not_compiled, e.p);
+        dynamic_exit(JIT_CONTINUE);
+        Emitter::patch(matched, e.p);
+        dynamic_exit(JIT_CHECK_LOOP);
+        Emitter::patch(loop_snapshot, e.p);
+        dynamic_exit(JIT_LOOP_SNAPSHOT);
+        Emitter::patch(paused, e.p);
+        dynamic_exit(JIT_PAUSE);
+        ended = true;
+        break;
+      }
+      default: {
+        // conditional branches compare against R0, unsigned
+        static const int CONDITIONS[] = {CC_E, CC_NE, CC_B, CC_A, CC_BE, CC_AE};
+        uint8_t *taken;
+
+        e.load16(RAX, R12, left);
+        e.load16(RCX, R12, 0);
+        e.alu(ALU_CMP, RAX, RCX);
+        taken = e.jcc(CONDITIONS[d.handler - BEQ_HANDLER]);
+        exit_to(p + 1);
+        Emitter::patch(taken, e.p);
+        count_taken();
+        branch_to(d.target);
+        ended = true;
+        break;
+      }
+    }
+  }
+
+  for (auto &stub : stubs) {
+    Emitter::patch(stub.jump, e.p);
+    e.store16_imm(RBX, offsetof(JitContext, pc), stub.pc);
+    e.move_imm(RAX, stub.reason);
+    Emitter::patch(e.jmp(), epilogue_);
+  }
+  used_ = e.p - memory_;
+
+  // everything that was waiting for this block now jumps straight to it
+  for (auto site : pending_[pc]) {
+    Emitter patcher = {site};
+    Emitter::patch(patcher.jmp(), entry);
+  }
+  pending_[pc].clear();
+
+  set_writable(false);
+  return entry;
+}
+
+JitExit Jit::enter(JitContext &context, JitBlock block) const {
+  return reinterpret_cast<Trampoline>(memory_)(&context, block,
+                                              blocks_.data());
+}
+
+#else  // !JIT_X86_64
+
+// no code generator for this host, every block is left to the interpreter
+Jit::Jit(const DecodedInstr *program, int code_size, int data_size,
+         bool paged_data, int32_t loop_threshold)
+    : program_(program),
+      code_size_(code_size),
+      data_size_(data_size),
+      paged_data_(paged_data),
+      loop_threshold_(loop_threshold),
+      memory_(nullptr),
+      used_(0),
+      epilogue_(nullptr),
+      blocks_(code_size),
+      pending_(code_size) {}
+
+Jit::~Jit() {}
+
+void Jit::set_writable(bool) {}
+
+void Jit::emit_trampoline() {}
+
+JitBlock Jit::compile(uint16_t) { return nullptr; }
+
+JitExit Jit::enter(JitContext &, JitBlock) const { return JIT_CONTINUE; }
+
+#endif  // JIT_X86_64
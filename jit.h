@@ -0,0 +1,118 @@
+// A just-in-time compiler that turns basic blocks of the decoded program into
+// x86-64 machine code. Blocks start wherever the dispatcher asks for one and
+// end at the first branch, JR or illegal instruction. The generated code works
+// directly on the simulator's registers, data and loop counters, and leaves
+// the full loop detector checks to the dispatcher; anything it can't run is
+// left to the interpreter.
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "data_area.h"
+#include "isa.h"
+#include "loop_detector.h"
+
+// the state the generated code reads and writes
+struct JIT_CONTEXT {
+  uint16_t *registers;         // the general registers
+  uint8_t (*data)[WORD_SIZE];  // the data area, unless it is paged
+  DataPage *const *pages;      // the page table of a paged data area
+  int32_t *loop_counts;        // executions so far per PC
+  int32_t *taken_counts;       // taken branches so far per PC
+  void *detector;              // the BasicLoopDetector, checked at branch
+                               // targets and hashed on stores
+  const void *pause;           // a 16 bit flag, nonzero to stop at the next
+                               // taken branch
+  uint16_t pc;                 // where the generated code stopped
+};
+
+typedef struct JIT_CONTEXT JitContext;
+
+// why the generated code handed control back
+enum JIT_EXITS {
+  JIT_CONTINUE,         // reached code that isn't compiled, carry on at pc
+  JIT_ILLEGAL_ADDRESS,  // the instruction at pc touched a bad address
+  JIT_INFINITE_LOOP,    // the instruction at pc ran too often
+  JIT_CHECK_LOOP,       // back in the snapshot state, check the data area
+  JIT_LOOP_SNAPSHOT,    // the detector wants a new snapshot at pc
+  JIT_PAUSE,            // asked to stop, pc is the target of the branch
+                        // just taken
+  JIT_NEW_PAGE,         // the store at pc is the first to its page, and was
+                        // counted but not run
+};
+
+typedef enum JIT_EXITS JitExit;
+
+// entry point of a compiled block
+typedef const uint8_t *JitBlock;
+
+class Jit {
+ public:
+  /**
+   * set up an empty code cache for a program
+   * @param program the decoded code area, code_size records that must stay
+   *                valid and unchanged for the life of the compiler
+   * @param code_size words in the code area
+   * @param data_size words in the data area, addresses at or past it are
+   *                  illegal
+   * @param paged_data whether the data area is reached through
+   *                   JitContext::pages rather than JitContext::data
+   * @param loop_threshold executions of one PC that count as an infinite loop
+   */
+  Jit(const DecodedInstr *program, int code_size, int data_size,
+      bool paged_data, int32_t loop_threshold);
+  ~Jit();
+
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  /**
+   * @return false if this host can't run generated code at all
+   */
+  bool available() const { return memory_ != nullptr; }
+
+  /**
+   * @param pc address of the first instruction of the block
+   * @return the compiled block starting at pc, or nullptr
+   */
+  JitBlock block(uint16_t pc) const {
+    return pc < code_size_ ? blocks_[pc] : nullptr;
+  }
+
+  /**
+   * compile the block starting at pc and chain it to the blocks around it
+   * @param pc address of the first instruction of the block
+   * @return the block, or nullptr if it can't be compiled (illegal
+   *         instruction at pc, out of cache, no JIT on this host)
+   */
+  JitBlock compile(uint16_t pc);
+
+  /**
+   * run generated code until it leaves the cache
+   * @param context machine state, context.pc is set on return
+   * @param block where to start
+   * @return why the code stopped
+   */
+  JitExit enter(JitContext &context, JitBlock block) const;
+
+ private:
+  const DecodedInstr *program_;
+  int code_size_;
+  int data_size_;
+  bool paged_data_;
+  int32_t loop_threshold_;
+  uint8_t *memory_;  // executable code cache
+  size_t used_;
+  const uint8_t *epilogue_;
+  std::vector<JitBlock> blocks_;  // by PC
+  // exits waiting for a block at their target to be compiled
+  std::vector<std::vector<uint8_t *>> pending_;
+
+  void set_writable(bool writable);
+  void emit_trampoline();
+};
+
+#endif  // JIT_H_
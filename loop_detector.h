@@ -0,0 +1,162 @@
+// Infinite loop detection by machine state. The processor is deterministic,
+// so once it is back in a state it has been in before (same PC, registers and
+// data) it will go round the same way forever. Every loop has to take a
+// branch, so the state is only checked at the targets of taken branches.
+//
+// Rather than remember every state, the detector keeps one snapshot and
+// compares against it (Brent's cycle detection): a snapshot is retaken after
+// 1, 2, 4, 8, ... checks, which finds any cycle within a small multiple of its
+// length plus the run-up to it. The data area is tracked with a running hash
+// updated on every store, so a check costs a few compares; only a full match
+// is confirmed against the snapshot of the data area. The same store hook also
+// marks each written word in a bitmap, for dumps of just what a run changed.
+#ifndef LOOP_DETECTOR_H_
+#define LOOP_DETECTOR_H_
+
+#include <cstdint>
+#include <cstring>
+
+#include "data_area.h"
+#include "isa.h"
+
+// no snapshot yet. Every 16 bit PC is a real one on a 64K word code area,
+// so this is one past them all.
+#define LOOP_DETECTOR_NO_PC 0x10000
+// longest stretch between two snapshots
+#define LOOP_DETECTOR_MAX_POWER (1 << 30)
+
+// a random multiplier for every data address, the data hash is the sum of
+// key * (word - 0xFFFF) over the data area, so words that were never written
+// add nothing. One table covers every address, so a data area of any size
+// uses the same keys. It is worked out by the compiler, in
+// machine.cpp so there is only one copy.
+struct LOOP_HASH_KEYS {
+  uint64_t key[MAX_AREA_SIZE];
+
+  constexpr LOOP_HASH_KEYS() : key() {
+    for (int i = 0; i < MAX_AREA_SIZE; i++) {
+      // splitmix64
+      uint64_t z = (i + 1) * 0x9E3779B97F4A7C15ull;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      key[i] = z ^ (z >> 31);
+    }
+  }
+};
+
+extern const LOOP_HASH_KEYS LOOP_HASH_KEYS_TABLE;
+
+// The detector for a DataArea (see data_area.h). The members that don't
+// depend on the size come first, so the JIT can use the same offsets for
+// every size.
+template <class DataArea>
+struct BasicLoopDetector {
+  uint64_t data_hash;  // hash of the data area as it is now
+  int32_t countdown;   // checks left until the next snapshot
+  int32_t power;       // checks between the last snapshot and the next
+  // the snapshot, saved_pc is LOOP_DETECTOR_NO_PC until one is taken
+  uint32_t saved_pc;
+  uint16_t saved_registers[REGISTERS];
+  uint64_t saved_data_hash;
+  // a bit for every data word stored to since the reset
+  uint64_t stored[(DataArea::WORDS + 63) / 64];
+  DataArea saved_data;
+};
+
+// the detector of the classic machine
+typedef BasicLoopDetector<DenseData<DATA_SIZE>> LoopDetector;
+
+/**
+ * a data word as a number, big endian
+ */
+inline uint16_t loop_detector_word(const uint8_t *word) {
+  return word[0] << 8 | word[1];
+}
+
+/**
+ * start over for a freshly loaded data area
+ * @param detector the detector to reset
+ * @param data the data area
+ */
+template <class DataArea>
+inline void loop_detector_reset(BasicLoopDetector<DataArea> &detector,
+                                const DataArea &data) {
+  detector.data_hash = 0;
+  for (int n = 0; n < DataArea::PAGES; n++) {
+    const uint8_t(*page)[WORD_SIZE] = data.page(n);
+    const uint64_t *keys = LOOP_HASH_KEYS_TABLE.key + n * DataArea::PAGE_WORDS;
+
+    if (!page) continue;
+    for (int i = 0; i < DataArea::PAGE_WORDS; i++) {
+      detector.data_hash +=
+          keys[i] * (uint64_t)(loop_detector_word(page[i]) - 0xFFFF);
+    }
+  }
+  memset(detector.stored, 0, sizeof detector.stored);
+  detector.countdown = 1;
+  detector.power = 1;
+  // nothing of an earlier run's snapshot is left to match
+  detector.saved_pc = LOOP_DETECTOR_NO_PC;
+  memset(detector.saved_registers, 0, sizeof detector.saved_registers);
+  detector.saved_data_hash = 0;
+  detector.saved_data.clear();
+}
+
+/**
+ * keep the data hash and the stored bitmap up to date, call for every store
+ * to the data area
+ * @param detector the detector
+ * @param address word address that is written
+ * @param old_word what was there
+ * @param new_word what is there now
+ */
+template <class DataArea>
+inline void loop_detector_store(BasicLoopDetector<DataArea> &detector,
+                                uint16_t address, uint16_t old_word,
+                                uint16_t new_word) {
+  detector.data_hash +=
+      LOOP_HASH_KEYS_TABLE.key[address] * (uint64_t)(new_word - old_word);
+  detector.stored[address / 64] |= (uint64_t)1 << (address % 64);
+}
+
+/**
+ * remember the current state and double the distance to the next snapshot
+ */
+template <class DataArea>
+inline void loop_detector_snapshot(BasicLoopDetector<DataArea> &detector,
+                                   uint16_t pc, const uint16_t *registers,
+                                   const DataArea &data) {
+  detector.saved_pc = pc;
+  memcpy(detector.saved_registers, registers,
+         sizeof detector.saved_registers);
+  detector.saved_data_hash = detector.data_hash;
+  detector.saved_data = data;
+  if (detector.power < LOOP_DETECTOR_MAX_POWER) detector.power *= 2;
+  detector.countdown = detector.power;
+}
+
+/**
+ * check the state at the target of a taken branch
+ * @param detector the detector
+ * @param pc the branch target
+ * @param registers the general registers
+ * @param data the data area
+ * @return true if the machine has been in exactly this state before
+ */
+template <class DataArea>
+inline bool loop_detector_check(BasicLoopDetector<DataArea> &detector,
+                                uint16_t pc, const uint16_t *registers,
+                                const DataArea &data) {
+  if (pc == detector.saved_pc &&
+      detector.data_hash == detector.saved_data_hash &&
+      memcmp(registers, detector.saved_registers,
+             sizeof detector.saved_registers) == 0 &&
+      data.same(detector.saved_data)) {
+    return true;
+  }
+  if (--detector.countdown == 0)
+    loop_detector_snapshot(detector, pc, registers, data);
+  return false;
+}
+
+#endif  // LOOP_DETECTOR_H_
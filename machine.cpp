@@ -0,0 +1,1498 @@
+#include "machine.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "assemble.h"
+#include "dump.h"
+#include "image.h"
+#include "jit.h"
+#include "mapped_file.h"
+#include "trace.h"
+
+using namespace std;
+
+// lines in each part of the profile
+#define PROFILE_TOP 20
+
+// how many times the JIT engine interprets a PC before compiling a block there
+#define JIT_HOT_THRESHOLD 16
+
+///////////////////////////////////////////////
+// constants and structures
+
+// ------------------------------debug----------------
+
+const static char *OPCODES_STR[]{"ADD",  "SUB",   "AND",    "OR", "XOR",
+                                 "MOVE", "SHIFT", "BRANCH", "NUM"};
+
+// the mnemonic of each handler, the register and literal forms share one
+const static char *HANDLERS_STR[]{
+    "ADD",  "ADD",  "SUB",  "SUB",  "AND", "AND", "OR",  "OR",
+    "XOR",  "XOR",  "MOVE", "MOVE", "MOVE", "MOVE", "SRR", "SRL",
+    "JR",   "BEQ",  "BNE",  "BLT",  "BGT",  "BLE",  "BGE", "",
+};
+
+// ---------------------------------------------------
+
+// Superinstructions the threaded engine runs in place of a short sequence
+// that ends in a conditional branch. Every branch compares against R0, so
+// programs keep setting R0 or stepping a counter right before one. ADD also
+// covers SUB with the literal negated. They are numbered after the plain
+// handlers so both share one dispatch table, in groups of six that follow the
+// order of BEQ_HANDLER to BGE_HANDLER.
+enum SUPERINSTRUCTIONS {
+  // ADD/SUB Rx,literal; Bcc
+  ADD_BRANCH_SUPER = NUM_HANDLERS,
+  // MOVE Rx,literal; Bcc
+  MOVE_BRANCH_SUPER = ADD_BRANCH_SUPER + 6,
+  // ADD/SUB Rx,literal; MOVE Ry,literal; Bcc
+  ADD_MOVE_BRANCH_SUPER = MOVE_BRANCH_SUPER + 6,
+  NUM_DISPATCH_HANDLERS = ADD_MOVE_BRANCH_SUPER + 6
+};
+
+const static char *SUPERINSTRUCTIONS_STR[]{"ADD", "MOVE", "ADD+MOVE"};
+
+// standard function pointer to run our control unit state machine
+template <class G>
+using process_phase = Phase (*)(BasicMachine<G> &m);
+
+///////////////////////////////////////////////
+// prototypes
+template <class G>
+Phase fetch_instr(BasicMachine<G> &m);
+
+template <class G>
+Phase decode_instr(BasicMachine<G> &m);
+
+template <class G>
+Phase detecting_infinite_loop(BasicMachine<G> &m);
+
+template <class G>
+Phase fetch_operands(BasicMachine<G> &m);
+
+template <class G>
+Phase execute_instr(BasicMachine<G> &m);
+
+template <class G>
+Phase write_back(BasicMachine<G> &m);
+
+////////////////////////////////////////////////
+// local variables
+
+// what the processor sees when the PC runs off the end of the code area
+static const uint8_t g_out_of_code_inst[WORD_SIZE] = {0xFF, 0xFF};
+static const DecodedInstr g_out_of_code_decoded = {ILLEGAL_HANDLER, 0, 0,
+                                                   true, 0, 0};
+// what the engines poll when nothing can pause them
+static std::atomic<uint16_t> g_no_pause(0);
+
+// A list of handlers to process each state. Provides for a nice simple
+// state machine loop and is easily extended without using a huge
+// switch statement.
+template <class G>
+static process_phase<G> control_unit[NUM_PHASES] = {
+    fetch_instr<G>,    decode_instr<G>,  detecting_infinite_loop<G>,
+    fetch_operands<G>, execute_instr<G>, write_back<G>};
+
+// the data hash keys, see loop_detector.h
+const LOOP_HASH_KEYS LOOP_HASH_KEYS_TABLE{};
+
+// a page of 0xFFFF words, worked out by the compiler
+static constexpr DataPage blank_data_page() {
+  DataPage page{};
+
+  for (int i = 0; i < DATA_PAGE_WORDS; i++) {
+    page.words[i][0] = 0xFF;
+    page.words[i][1] = 0xFF;
+  }
+  return page;
+}
+
+// every untouched page of a paged data area, see data_area.h
+const DataPage BLANK_DATA_PAGE = blank_data_page();
+
+/**
+ * append the assembly form of an instruction
+ * @param raw the instruction word, big endian
+ * @param form leave out the operands' values, as in "ADD R,n", to name the
+ *             kind of instruction
+ */
+static void disassemble(const uint8_t *raw, bool form, string &out) {
+  const DecodeEntry &e = DECODE_TABLE_WORDS[raw];
+
+  // an illegal word is named by its opcode alone
+  out += e.legal ? HANDLERS_STR[e.handler] : OPCODES_STR[e.opcode];
+  out += ' ';
+
+  // a register or a literal operand
+  auto reg = [&](int number) {
+    out += 'R';
+    if (!form) out += std::to_string(number);
+  };
+  // literals are shown as the 6 bits the assembler put there
+  auto literal = [&]() {
+    out += form ? "n" : std::to_string(e.literal & 0b111111);
+  };
+
+  switch (e.handler) {
+    case ADD_LITERAL_HANDLER:
+    case SUB_LITERAL_HANDLER:
+    case AND_LITERAL_HANDLER:
+    case OR_LITERAL_HANDLER:
+    case XOR_LITERAL_HANDLER:
+    case MOVE_LITERAL_HANDLER:
+    case BEQ_HANDLER:
+    case BNE_HANDLER:
+    case BLT_HANDLER:
+    case BGT_HANDLER:
+    case BLE_HANDLER:
+    case BGE_HANDLER:
+      reg(e.left), out += ',', literal();
+      break;
+    case ADD_REGISTER_HANDLER:
+    case SUB_REGISTER_HANDLER:
+    case AND_REGISTER_HANDLER:
+    case OR_REGISTER_HANDLER:
+    case XOR_REGISTER_HANDLER:
+      reg(e.left), out += ',', reg(e.right);
+      break;
+    case MOVE_LOAD_HANDLER:
+      reg(e.left), out += ",[", reg(e.right), out += ']';
+      break;
+    case MOVE_STORE_LITERAL_HANDLER:
+      out += '[', reg(e.left), out += "],", literal();
+      break;
+    case MOVE_STORE_REGISTER_HANDLER:
+      out += '[', reg(e.left), out += "],", reg(e.right);
+      break;
+    case SHIFT_RIGHT_HANDLER:
+    case SHIFT_LEFT_HANDLER:
+    case JR_HANDLER:
+      reg(e.left);
+      break;
+    default:
+      break;
+  }
+}
+
+void format_instruction(const uint8_t *raw, string &out) {
+  disassemble(raw, false, out);
+}
+
+/////////////////////////////////////////////////
+// decoding
+
+/**
+ * decode the whole code area, must be called after the code is loaded
+ */
+template <class G>
+void predecode_program(BasicMachine<G> &m) {
+  for (int i = 0; i < G::CODE_WORDS; i++) {
+    m.decoded[i] = decode_word(m.code[i], i);
+  }
+}
+
+/**
+ * find the superinstructions in the decoded program. Every address keeps its
+ * plain handler unless a fusion starts there; the instructions a fusion
+ * covers keep their own records so branches into the middle still work.
+ * @param enabled false to leave every address with its plain handler
+ */
+template <class G>
+void fuse_program(BasicMachine<G> &m, bool enabled) {
+  for (int i = 0; i < G::CODE_WORDS; i++) {
+    auto &first = m.decoded[i];
+    auto &super = m.superinstructions[i];
+    bool is_add = first.handler == ADD_LITERAL_HANDLER ||
+                  first.handler == SUB_LITERAL_HANDLER;
+    int branch;
+
+    super.handler = first.handler;
+    super.length = 1;
+    super.addend = first.handler == SUB_LITERAL_HANDLER ? -first.literal
+                                                        : first.literal;
+    if (!enabled || i + 1 >= G::CODE_WORDS) continue;
+
+    if (is_add && m.decoded[i + 1].handler == MOVE_LITERAL_HANDLER &&
+        i + 2 < G::CODE_WORDS) {
+      branch = m.decoded[i + 2].handler - BEQ_HANDLER;
+      if (branch >= 0 && branch <= BGE_HANDLER - BEQ_HANDLER) {
+        super.handler = ADD_MOVE_BRANCH_SUPER + branch;
+        super.length = 3;
+        continue;
+      }
+    }
+    branch = m.decoded[i + 1].handler - BEQ_HANDLER;
+    if (branch < 0 || branch > BGE_HANDLER - BEQ_HANDLER) continue;
+    if (is_add) {
+      super.handler = ADD_BRANCH_SUPER + branch;
+      super.length = 2;
+    } else if (first.handler == MOVE_LITERAL_HANDLER) {
+      super.handler = MOVE_BRANCH_SUPER + branch;
+      super.length = 2;
+    }
+  }
+}
+
+// the superinstructions with how often each one was dispatched, meant for
+// stderr so the simulator's own output stays untouched
+template <class G>
+void BasicMachine<G>::print_fusion_report(string &out) const {
+  vector<int64_t> dispatches(CODE_WORDS);
+  int64_t executed = 0;
+  int64_t saved = 0;
+
+  // an address's count includes the runs where a superinstruction before it
+  // stepped into it rather than dispatching it
+  for (int i = 0; i < CODE_WORDS; i++) {
+    dispatches[i] = loop_counts[i];
+    executed += loop_counts[i];
+    for (int j = i - 1; j >= 0 && j >= i - 2; j--) {
+      if (superinstructions[j].length > i - j)
+        dispatches[i] -= dispatches[j];
+    }
+  }
+
+  char line[80];
+
+  out += "superinstructions:\n";
+  for (int i = 0; i < CODE_WORDS; i++) {
+    auto &super = superinstructions[i];
+
+    if (super.length == 1 || dispatches[i] == 0) continue;
+    int pattern = (super.handler - ADD_BRANCH_SUPER) / 6;
+    int branch = (super.handler - ADD_BRANCH_SUPER) % 6;
+    snprintf(line, sizeof line, "  %04x  %s+%s  %lld\n", i,
+             SUPERINSTRUCTIONS_STR[pattern], HANDLERS_STR[BEQ_HANDLER + branch],
+             (long long)dispatches[i]);
+    out += line;
+    saved += dispatches[i] * (super.length - 1);
+  }
+  snprintf(line, sizeof line,
+           "dispatches: %lld for %lld instructions (%lld saved)\n",
+           (long long)(executed - saved), (long long)executed,
+           (long long)saved);
+  out += line;
+}
+
+/**
+ * @return the label at or before a code address with the distance from it,
+ *         as in "loop+2", or "" without one
+ */
+static string label_for(const vector<string> &labels, int pc) {
+  for (int i = std::min(pc, (int)labels.size() - 1); i >= 0; i--) {
+    if (labels[i].empty()) continue;
+    return i == pc ? labels[i] : labels[i] + "+" + std::to_string(pc - i);
+  }
+  return "";
+}
+
+// Everything here comes from the counts the engines keep anyway, so a
+// profiled run is as fast as any other.
+template <class G>
+void BasicMachine<G>::print_profile(string &out,
+                                    const vector<string> &labels) const {
+  // on the heap, a large machine's would crowd the stack
+  vector<DecodedInstr> program(CODE_WORDS);
+  int64_t kinds[64] = {};  // executions per opcode category and type
+  vector<int64_t> block_runs(CODE_WORDS);  // instructions run in the block
+  vector<int> block_ends(CODE_WORDS);
+  vector<char> leader(CODE_WORDS + 1);
+  int64_t executed = 0;
+  vector<int64_t> counts(CODE_WORDS);  // executions per address
+  vector<int> order(CODE_WORDS);
+  int shown;
+  char line[160];
+
+  // an engine may count an illegal instruction as it stops there, but it
+  // never ran
+  for (int i = 0; i < CODE_WORDS; i++) {
+    program[i] = decoded[i].valid ? decoded[i] : decode_word(code[i], i);
+    counts[i] = program[i].handler == ILLEGAL_HANDLER ? 0 : loop_counts[i];
+    executed += counts[i];
+    kinds[code[i][0] >> 2] += counts[i];
+  }
+  snprintf(line, sizeof line, "profile: %lld instructions\n",
+           (long long)executed);
+  out += line;
+  if (executed == 0) return;
+
+  // a pc with its label and instruction
+  auto describe = [&](int pc) {
+    string label = label_for(labels, pc);
+
+    snprintf(line, sizeof line, "  %04x  %-12s  ", pc, label.c_str());
+    out += line;
+    format_instruction(code[pc], out);
+    out += '\n';
+  };
+  auto percent = [&](int64_t count) { return 100.0 * count / executed; };
+  // the addresses by a count, highest first
+  auto rank = [&](const int64_t *counts, int size) {
+    for (int i = 0; i < size; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.begin() + size, [&](int a, int b) {
+      return counts[a] > counts[b];
+    });
+  };
+
+  out += "hot spots:\n";
+  rank(counts.data(), CODE_WORDS);
+  for (shown = 0; shown < PROFILE_TOP && counts[order[shown]]; shown++) {
+    snprintf(line, sizeof line, "  %10lld %5.1f%%",
+             (long long)counts[order[shown]], percent(counts[order[shown]]));
+    out += line;
+    describe(order[shown]);
+  }
+
+  out += "instructions:\n";
+  rank(kinds, 64);
+  for (shown = 0; shown < 64 && kinds[order[shown]]; shown++) {
+    uint8_t raw[WORD_SIZE] = {(uint8_t)(order[shown] << 2), 0};
+
+    snprintf(line, sizeof line, "  %10lld %5.1f%%  ",
+             (long long)kinds[order[shown]], percent(kinds[order[shown]]));
+    out += line;
+    disassemble(raw, true, out);
+    out += '\n';
+  }
+
+  // basic blocks start at the entry, after every branch and at every
+  // branch target the decoder knows; JR targets aren't known until run time
+  leader[0] = true;
+  for (int i = 0; i < CODE_WORDS; i++) {
+    if (program[i].handler < JR_HANDLER ||
+        program[i].handler == ILLEGAL_HANDLER) {
+      continue;
+    }
+    leader[i + 1] = true;
+    if (program[i].handler > JR_HANDLER && program[i].target < CODE_WORDS) {
+      leader[program[i].target] = true;
+    }
+  }
+  for (int i = 0, start = 0; i < CODE_WORDS; i++) {
+    if (leader[i]) start = i;
+    block_runs[start] += counts[i];
+    block_ends[start] = i;
+  }
+  out += "blocks:\n";
+  rank(block_runs.data(), CODE_WORDS);
+  for (shown = 0; shown < PROFILE_TOP && block_runs[order[shown]]; shown++) {
+    int start = order[shown];
+    string label = label_for(labels, start);
+
+    snprintf(line, sizeof line,
+             "  %10lld %5.1f%%  %04x-%04x  %-12s  entered %d\n",
+             (long long)block_runs[start], percent(block_runs[start]), start,
+             block_ends[start], label.c_str(), loop_counts[start]);
+    out += line;
+  }
+
+  out += "branches, taken and not taken:\n";
+  // only the branches are left in the counts
+  for (int i = 0; i < CODE_WORDS; i++) {
+    if (program[i].handler < JR_HANDLER) counts[i] = 0;
+  }
+  rank(counts.data(), CODE_WORDS);
+  for (shown = 0; shown < PROFILE_TOP && counts[order[shown]]; shown++) {
+    int pc = order[shown];
+
+    snprintf(line, sizeof line, "  %10d %10d", taken_counts[pc],
+             loop_counts[pc] - taken_counts[pc]);
+    out += line;
+    describe(pc);
+  }
+}
+
+/////////////////////////////////////////////////
+// state processing routines
+/**
+ * fetching instruction from code section (code array)
+ * @return Phase enum
+ */
+template <class G>
+Phase fetch_instr(BasicMachine<G> &m) {
+  if (m.register_pc >= G::CODE_WORDS) {
+    m.current_inst_raw = g_out_of_code_inst;
+    m.current_decoded = &g_out_of_code_decoded;
+    return DECODE_INSTR;
+  }
+  m.current_inst_raw = m.code[m.register_pc];
+  if (!m.decoded[m.register_pc].valid) {
+    m.decoded[m.register_pc] = decode_word(m.current_inst_raw, m.register_pc);
+  }
+  m.current_decoded = &m.decoded[m.register_pc];
+  return DECODE_INSTR;
+}
+
+/**
+ * pick up the operands of the predecoded instruction so that later phase can
+ * use them
+ * @return Phase enum
+ */
+template <class G>
+Phase decode_instr(BasicMachine<G> &m) {
+  auto &decoded = *m.current_decoded;
+
+  m.current_operand_left = &m.registers_general[decoded.left];
+  m.current_operand_right = nullptr;
+  m.current_operand_right_need_fetch = false;
+  switch (decoded.handler) {
+    case ILLEGAL_HANDLER:
+      return ILLEGAL_OPCODE;
+    case MOVE_LOAD_HANDLER:
+      m.current_operand_right = &m.registers_general[decoded.right];
+      m.current_operand_right_need_fetch = true;
+      break;
+    case ADD_REGISTER_HANDLER:
+    case SUB_REGISTER_HANDLER:
+    case AND_REGISTER_HANDLER:
+    case OR_REGISTER_HANDLER:
+    case XOR_REGISTER_HANDLER:
+    case MOVE_STORE_REGISTER_HANDLER:
+      m.current_operand_right = &m.registers_general[decoded.right];
+      m.current_operand_right_fetched =
+          sign_extend(*m.current_operand_right, 6);
+      break;
+    default:
+      m.current_operand_right_fetched = decoded.literal;
+  }
+  return CALCULATE_EA;
+}
+
+/**
+ * detecting infinite loop
+ * @return Phase enum
+ */
+template <class G>
+Phase detecting_infinite_loop(BasicMachine<G> &m) {
+  if (m.branch_taken) {
+    m.branch_taken = false;
+    if (loop_detector_check(m.loop_detector, m.register_pc,
+                            m.registers_general, m.data)) {
+      return INFINITE_LOOP;
+    }
+    // a run pauses at the target of a taken branch once it is checked, as
+    // the other engines do, and carries on by fetching it again
+    if (m.pause && m.pause->load(std::memory_order_relaxed)) return PAUSED;
+  }
+  if (++m.loop_counts[m.register_pc] > INFINITE_LOOP_TRIGGER_THRESHOLD) {
+    return INFINITE_LOOP;
+  }
+  return FETCH_OPERANDS;
+}
+
+/**
+ * fetch from memory (data array)
+ * @return Phase enum
+ */
+template <class G>
+Phase fetch_operands(BasicMachine<G> &m) {
+  if (m.current_operand_right_need_fetch) {
+    if (*m.current_operand_right >= G::DATA_WORDS) {
+      return ILLEGAL_ADDRESS;
+    }
+    auto d = m.data.word(*m.current_operand_right);
+    m.current_operand_right_fetched =
+        sign_extend((d[0] << 8 & 0b111111110000000) | d[1], 6);
+  }
+  return EXECUTE_INSTR;
+}
+
+/**
+ * executing decoded instruction
+ * @return Phase enum
+ */
+template <class G>
+Phase execute_instr(BasicMachine<G> &m) {
+  auto &left = *m.current_operand_left;
+  auto right = m.current_operand_right_fetched;
+  auto &decoded = *m.current_decoded;
+  uint16_t pc = m.register_pc;
+  bool is_jumped = false;
+  switch (decoded.handler) {
+    case ADD_LITERAL_HANDLER:
+    case ADD_REGISTER_HANDLER:
+      left += right;
+      break;
+    case SUB_LITERAL_HANDLER:
+    case SUB_REGISTER_HANDLER:
+      left -= right;
+      break;
+    case AND_LITERAL_HANDLER:
+    case AND_REGISTER_HANDLER:
+      left &= right;
+      break;
+    case OR_LITERAL_HANDLER:
+    case OR_REGISTER_HANDLER:
+      left |= right;
+      break;
+    case XOR_LITERAL_HANDLER:
+    case XOR_REGISTER_HANDLER:
+      left ^= right;
+      break;
+    case MOVE_LITERAL_HANDLER:
+    case MOVE_LOAD_HANDLER:
+      left = right;
+      break;
+    case MOVE_STORE_LITERAL_HANDLER:
+    case MOVE_STORE_REGISTER_HANDLER: {
+      uint8_t *word;
+
+      if (left >= G::DATA_WORDS) {
+        return ILLEGAL_ADDRESS;
+      }
+      word = m.data.writable(left);
+      loop_detector_store(m.loop_detector, left, loop_detector_word(word),
+                          right);
+      // big endian
+      word[0] = right >> 8 & 0xFF;
+      word[1] = right & 0xFF;
+      break;
+    }
+    case SHIFT_RIGHT_HANDLER:
+      left >>= 1;
+      break;
+    case SHIFT_LEFT_HANDLER:
+      left <<= 1;
+      break;
+    case JR_HANDLER:  // JR direct jump
+      m.register_pc = left - 1;
+      is_jumped = true;
+      break;
+    case BEQ_HANDLER:
+      is_jumped = left == m.registers_general[0];
+      break;
+    case BNE_HANDLER:
+      is_jumped = left != m.registers_general[0];
+      break;
+    case BLT_HANDLER:
+      is_jumped = left < m.registers_general[0];
+      break;
+    case BGT_HANDLER:
+      is_jumped = left > m.registers_general[0];
+      break;
+    case BLE_HANDLER:
+      is_jumped = left <= m.registers_general[0];
+      break;
+    case BGE_HANDLER:
+      is_jumped = left >= m.registers_general[0];
+      break;
+    default:
+      return ILLEGAL_OPCODE;
+  }
+  if (!is_jumped) {
+    m.register_pc++;
+  } else if (decoded.handler != JR_HANDLER) {
+    m.register_pc = decoded.target;
+  }
+  m.branch_taken = is_jumped;
+  m.taken_counts[pc] += is_jumped;
+  return WRITE_BACK;
+}
+
+/**
+ * nothing left to write, but a traced run records the instruction here
+ * @return Phase enum
+ */
+template <class G>
+Phase write_back(BasicMachine<G> &m) {
+  if (m.trace) {
+    auto &decoded = *m.current_decoded;
+    TraceRecord record = {};
+
+    record.counter = m.instruction_counter++;
+    record.pc = m.current_decoded - m.decoded;
+    memcpy(record.instruction, m.current_inst_raw, WORD_SIZE);
+    if (decoded.handler == MOVE_STORE_LITERAL_HANDLER ||
+        decoded.handler == MOVE_STORE_REGISTER_HANDLER) {
+      record.change = TRACE_MEMORY;
+      record.where = *m.current_operand_left;
+      record.value = loop_detector_word(m.data.word(record.where));
+    } else if (decoded.handler < JR_HANDLER) {
+      record.change = TRACE_REGISTER;
+      record.where = decoded.left;
+      record.value = m.registers_general[decoded.left];
+    }
+    m.trace->record(record);
+  }
+  return FETCH_INSTR;
+}
+
+/////////////////////////////////////////////////
+// execution engines
+
+/**
+ * run the program through the control unit state machine, one phase at a time
+ * @return the Phase that stopped the processor
+ */
+template <class G>
+Phase run_phases(BasicMachine<G> &m) {
+  Phase current_phase = FETCH_INSTR;  // we always start if an instruction fetch
+
+  while (current_phase < NUM_PHASES)
+    current_phase = control_unit<G>[current_phase](m);
+  return current_phase;
+}
+
+// the threaded engine jumps straight from handler to handler with computed
+// gotos where the compiler supports them, and falls back to a switch otherwise
+#if defined(__GNUC__)
+#define THREADED_GOTO 1
+#else
+#define THREADED_GOTO 0
+#endif
+
+/**
+ * run the program with a direct-threaded interpreter. Every address is mapped
+ * to the handler (or superinstruction, see fuse_program()) that executes it,
+ * so each dispatch costs a single indirect jump, and the machine state stays
+ * in locals until the processor stops.
+ * @return the Phase that stopped the processor
+ */
+template <class G>
+Phase run_threaded(BasicMachine<G> &m, bool fusion) {
+  uint16_t regs[REGISTERS];
+  uint16_t pc = m.register_pc;
+  uint16_t address;
+  const uint8_t *loaded;
+  Phase result;
+  const DecodedInstr *program = m.decoded;
+  const DecodedInstr *d;
+  auto &data = m.data;
+  int32_t *loop_counts = m.loop_counts;
+  int32_t *taken_counts = m.taken_counts;
+  auto &detector = m.loop_detector;
+  const std::atomic<uint16_t> *pause = m.pause ? m.pause : &g_no_pause;
+#if THREADED_GOTO
+  // in the same order as HANDLERS and SUPERINSTRUCTIONS
+  static const void *const handlers[NUM_DISPATCH_HANDLERS] = {
+      &&add_literal,  &&add_register,       &&sub_literal,
+      &&sub_register, &&and_literal,        &&and_register,
+      &&or_literal,   &&or_register,        &&xor_literal,
+      &&xor_register, &&move_literal,       &&move_load,
+      &&move_store_literal,                 &&move_store_register,
+      &&shift_right,  &&shift_left,         &&jr,
+      &&beq,          &&bne,                &&blt,
+      &&bgt,          &&ble,                &&bge,
+      &&illegal_opcode,
+      &&add_beq,      &&add_bne,            &&add_blt,
+      &&add_bgt,      &&add_ble,            &&add_bge,
+      &&move_beq,     &&move_bne,           &&move_blt,
+      &&move_bgt,     &&move_ble,           &&move_bge,
+      &&add_move_beq, &&add_move_bne,       &&add_move_blt,
+      &&add_move_bgt, &&add_move_ble,       &&add_move_bge};
+  // one extra slot so running off the end of the code is caught by dispatch.
+  // On the heap, a 64K word code area would make it 512K of stack.
+  std::unique_ptr<const void *[]> threaded_table(
+      new const void *[G::CODE_WORDS + 1]);
+  const void **threaded = threaded_table.get();
+#endif
+
+  memcpy(regs, m.registers_general, sizeof regs);
+  for (int i = 0; i < G::CODE_WORDS; i++) {
+    if (!m.decoded[i].valid) m.decoded[i] = decode_word(m.code[i], i);
+  }
+  fuse_program(m, fusion);
+#if THREADED_GOTO
+  for (int i = 0; i < G::CODE_WORDS; i++) {
+    threaded[i] = handlers[m.superinstructions[i].handler];
+  }
+  threaded[G::CODE_WORDS] = &&out_of_code;
+#endif
+
+#if THREADED_GOTO
+#define HANDLER(label, handler) label:
+#define DISPATCH() goto *threaded[pc]
+#else
+#define HANDLER(label, handler) case handler:
+#define DISPATCH() goto dispatch
+#endif
+
+// count the instruction we are about to run, then jump to its handler
+#define NEXT()                                                   \
+  do {                                                           \
+    if (++loop_counts[pc] > INFINITE_LOOP_TRIGGER_THRESHOLD)     \
+      goto infinite_loop;                                        \
+    d = &program[pc];                                            \
+    DISPATCH();                                                  \
+  } while (0)
+
+// branches can land anywhere in the 16 bit address space, and the state at
+// a branch target is what the loop detector looks at. A paused run carries
+// on from there.
+#define JUMP(destination)                                        \
+  do {                                                           \
+    pc = (destination);                                          \
+    if (pc >= G::CODE_WORDS) goto out_of_code;                   \
+    if (loop_detector_check(detector, pc, regs, data))           \
+      goto infinite_loop;                                        \
+    if (pause->load(std::memory_order_relaxed)) goto paused;     \
+    NEXT();                                                      \
+  } while (0)
+
+// a store to the data area, address already checked
+#define STORE(value)                                             \
+  do {                                                           \
+    uint16_t word = (value);                                     \
+    uint8_t *stored = data.writable(address);                    \
+    loop_detector_store(detector, address,                       \
+                        loop_detector_word(stored), word);       \
+    /* big endian */                                             \
+    stored[0] = word >> 8;                                       \
+    stored[1] = word & 0xFF;                                     \
+  } while (0)
+
+#define BRANCH(condition)                                        \
+  do {                                                           \
+    if (condition) {                                             \
+      taken_counts[pc]++;                                        \
+      JUMP(d->target);                                           \
+    }                                                            \
+    pc++;                                                        \
+    NEXT();                                                      \
+  } while (0)
+
+// register values pass through the same 6 bit sign extension as literals
+#define RIGHT_REGISTER() sign_extend(regs[d->right], 6)
+
+// move on to the next instruction inside a superinstruction, counted the same
+// as if it had been dispatched
+#define STEP()                                                   \
+  do {                                                           \
+    pc++;                                                        \
+    if (++loop_counts[pc] > INFINITE_LOOP_TRIGGER_THRESHOLD)     \
+      goto infinite_loop;                                        \
+    d++;                                                         \
+  } while (0)
+
+// the three superinstructions ending in one kind of branch
+#define FUSED_BRANCH(name, NAME, comparison)                     \
+  HANDLER(add_##name, ADD_BRANCH_SUPER + NAME - BEQ_HANDLER)     \
+  regs[d->left] += m.superinstructions[pc].addend;               \
+  STEP();                                                        \
+  BRANCH(regs[d->left] comparison regs[0]);                      \
+  HANDLER(move_##name, MOVE_BRANCH_SUPER + NAME - BEQ_HANDLER)   \
+  regs[d->left] = d->literal;                                    \
+  STEP();                                                        \
+  BRANCH(regs[d->left] comparison regs[0]);                      \
+  HANDLER(add_move_##name,                                       \
+          ADD_MOVE_BRANCH_SUPER + NAME - BEQ_HANDLER)            \
+  regs[d->left] += m.superinstructions[pc].addend;               \
+  STEP();                                                        \
+  regs[d->left] = d->literal;                                    \
+  STEP();                                                        \
+  BRANCH(regs[d->left] comparison regs[0]);
+
+  if (pc >= G::CODE_WORDS) goto out_of_code;
+  NEXT();
+
+#if !THREADED_GOTO
+dispatch:
+  if (pc >= G::CODE_WORDS) goto out_of_code;
+  switch (m.superinstructions[pc].handler) {
+#endif
+    HANDLER(add_literal, ADD_LITERAL_HANDLER)
+    regs[d->left] += d->literal;
+    pc++;
+    NEXT();
+    HANDLER(add_register, ADD_REGISTER_HANDLER)
+    regs[d->left] += RIGHT_REGISTER();
+    pc++;
+    NEXT();
+    HANDLER(sub_literal, SUB_LITERAL_HANDLER)
+    regs[d->left] -= d->literal;
+    pc++;
+    NEXT();
+    HANDLER(sub_register, SUB_REGISTER_HANDLER)
+    regs[d->left] -= RIGHT_REGISTER();
+    pc++;
+    NEXT();
+    HANDLER(and_literal, AND_LITERAL_HANDLER)
+    regs[d->left] &= d->literal;
+    pc++;
+    NEXT();
+    HANDLER(and_register, AND_REGISTER_HANDLER)
+    regs[d->left] &= RIGHT_REGISTER();
+    pc++;
+    NEXT();
+    HANDLER(or_literal, OR_LITERAL_HANDLER)
+    regs[d->left] |= d->literal;
+    pc++;
+    NEXT();
+    HANDLER(or_register, OR_REGISTER_HANDLER)
+    regs[d->left] |= RIGHT_REGISTER();
+    pc++;
+    NEXT();
+    HANDLER(xor_literal, XOR_LITERAL_HANDLER)
+    regs[d->left] ^= d->literal;
+    pc++;
+    NEXT();
+    HANDLER(xor_register, XOR_REGISTER_HANDLER)
+    regs[d->left] ^= RIGHT_REGISTER();
+    pc++;
+    NEXT();
+    HANDLER(move_literal, MOVE_LITERAL_HANDLER)
+    regs[d->left] = d->literal;
+    pc++;
+    NEXT();
+    HANDLER(move_load, MOVE_LOAD_HANDLER)
+    address = regs[d->right];
+    if (address >= G::DATA_WORDS) goto illegal_address;
+    loaded = data.word(address);
+    regs[d->left] =
+        sign_extend((loaded[0] << 8 & 0b111111110000000) | loaded[1], 6);
+    pc++;
+    NEXT();
+    HANDLER(move_store_literal, MOVE_STORE_LITERAL_HANDLER)
+    address = regs[d->left];
+    if (address >= G::DATA_WORDS) goto illegal_address;
+    STORE(d->literal);
+    pc++;
+    NEXT();
+    HANDLER(move_store_register, MOVE_STORE_REGISTER_HANDLER)
+    address = regs[d->left];
+    if (address >= G::DATA_WORDS) goto illegal_address;
+    STORE(RIGHT_REGISTER());
+    pc++;
+    NEXT();
+    HANDLER(shift_right, SHIFT_RIGHT_HANDLER)
+    regs[d->left] >>= 1;
+    pc++;
+    NEXT();
+    HANDLER(shift_left, SHIFT_LEFT_HANDLER)
+    regs[d->left] <<= 1;
+    pc++;
+    NEXT();
+    HANDLER(jr, JR_HANDLER)
+    taken_counts[pc]++;
+    JUMP(regs[d->left] - 1);
+    HANDLER(beq, BEQ_HANDLER)
+    BRANCH(regs[d->left] == regs[0]);
+    HANDLER(bne, BNE_HANDLER)
+    BRANCH(regs[d->left] != regs[0]);
+    HANDLER(blt, BLT_HANDLER)
+    BRANCH(regs[d->left] < regs[0]);
+    HANDLER(bgt, BGT_HANDLER)
+    BRANCH(regs[d->left] > regs[0]);
+    HANDLER(ble, BLE_HANDLER)
+    BRANCH(regs[d->left] <= regs[0]);
+    HANDLER(bge, BGE_HANDLER)
+    BRANCH(regs[d->left] >= regs[0]);
+    FUSED_BRANCH(beq, BEQ_HANDLER, ==)
+    FUSED_BRANCH(bne, BNE_HANDLER, !=)
+    FUSED_BRANCH(blt, BLT_HANDLER, <)
+    FUSED_BRANCH(bgt, BGT_HANDLER, >)
+    FUSED_BRANCH(ble, BLE_HANDLER, <=)
+    FUSED_BRANCH(bge, BGE_HANDLER, >=)
+#if !THREADED_GOTO
+    default:
+      goto illegal_opcode;
+  }
+#endif
+
+illegal_opcode:
+  result = ILLEGAL_OPCODE;
+  goto stop;
+infinite_loop:
+  result = INFINITE_LOOP;
+  goto stop;
+illegal_address:
+  result = ILLEGAL_ADDRESS;
+  goto stop;
+paused:
+  result = PAUSED;
+  goto stop;
+out_of_code:
+  result = ILLEGAL_OPCODE;
+
+stop:
+  // hand the state back so it can be reported like any other engine
+  memcpy(m.registers_general, regs, sizeof regs);
+  m.register_pc = pc;
+  m.current_inst_raw = pc < G::CODE_WORDS ? m.code[pc] : g_out_of_code_inst;
+  return result;
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef BRANCH
+#undef RIGHT_REGISTER
+#undef STORE
+#undef STEP
+#undef FUSED_BRANCH
+}
+
+/**
+ * run a single instruction through the control unit
+ * @return FETCH_INSTR, or the Phase that stopped the processor
+ */
+template <class G>
+Phase step_instruction(BasicMachine<G> &m) {
+  Phase phase = FETCH_INSTR;
+
+  do {
+    phase = control_unit<G>[phase](m);
+  } while (phase != FETCH_INSTR && phase < NUM_PHASES);
+  return phase;
+}
+
+/**
+ * run the program with the JIT. A PC that keeps coming back to the dispatcher
+ * gets its block compiled, blocks chain into each other directly, and whatever
+ * isn't compiled (cold code, illegal instructions, a full code cache, a host
+ * without a code generator) is interpreted one instruction at a time.
+ * @return the Phase that stopped the processor
+ */
+template <class G>
+Phase run_jit(BasicMachine<G> &m) {
+  uint8_t hotness[G::CODE_WORDS] = {};
+  JitContext context = {m.registers_general, m.data.words(),
+                        m.data.page_table(), m.loop_counts, m.taken_counts,
+                        &m.loop_detector, m.pause ? m.pause : &g_no_pause,
+                        0};
+  Phase phase = FETCH_INSTR;
+
+  for (int i = 0; i < G::CODE_WORDS; i++) {
+    if (!m.decoded[i].valid) m.decoded[i] = decode_word(m.code[i], i);
+  }
+  Jit jit(m.decoded, G::CODE_WORDS, G::DATA_WORDS, G::PAGED_DATA,
+          INFINITE_LOOP_TRIGGER_THRESHOLD);
+
+  while (phase == FETCH_INSTR) {
+    JitBlock block = jit.block(m.register_pc);
+
+    if (!block && m.register_pc < G::CODE_WORDS &&
+        ++hotness[m.register_pc] == JIT_HOT_THRESHOLD) {
+      block = jit.compile(m.register_pc);
+    }
+    if (!block) {
+      phase = step_instruction(m);
+      continue;
+    }
+
+    // an interpreted branch into compiled code still has its target checked
+    if (m.branch_taken) {
+      m.branch_taken = false;
+      if (loop_detector_check(m.loop_detector, m.register_pc,
+                              m.registers_general, m.data)) {
+        phase = INFINITE_LOOP;
+        break;
+      }
+    }
+
+    context.pc = m.register_pc;
+    switch (jit.enter(context, block)) {
+      case JIT_ILLEGAL_ADDRESS:
+        phase = ILLEGAL_ADDRESS;
+        break;
+      case JIT_INFINITE_LOOP:
+        phase = INFINITE_LOOP;
+        break;
+      case JIT_PAUSE:
+        phase = PAUSED;
+        break;
+      case JIT_CHECK_LOOP:
+        if (loop_detector_check(m.loop_detector, context.pc,
+                                m.registers_general, m.data)) {
+          phase = INFINITE_LOOP;
+        }
+        break;
+      case JIT_LOOP_SNAPSHOT:
+        loop_detector_snapshot(m.loop_detector, context.pc, m.registers_general,
+                               m.data);
+        break;
+      case JIT_NEW_PAGE:
+        // the interpreter runs the store, which makes the page, and counts
+        // it again
+        m.loop_counts[context.pc]--;
+        m.register_pc = context.pc;
+        phase = step_instruction(m);
+        context.pc = m.register_pc;
+        break;
+      default:
+        break;
+    }
+    m.register_pc = context.pc;
+  }
+  if (phase != FETCH_INSTR && m.register_pc < G::CODE_WORDS) {
+    m.current_inst_raw = m.code[m.register_pc];
+  }
+  return phase;
+}
+
+// The lockstep engine keeps each register of all its lanes in one vector of
+// uint16_t, a single AVX2 register (two SSE registers on hosts without AVX2).
+// It is written with the GCC vector extensions; other compilers get the lanes
+// run one after the other instead.
+#if defined(__GNUC__)
+#define LOCKSTEP_VECTORS 1
+typedef uint16_t LaneWords __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+#else
+#define LOCKSTEP_VECTORS 0
+#endif
+
+// build the lockstep engine for AVX2 as well and pick at load time
+#if LOCKSTEP_VECTORS && defined(__x86_64__) && defined(__linux__) && \
+    defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define LOCKSTEP_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef LOCKSTEP_CLONES
+#define LOCKSTEP_CLONES
+#endif
+
+/**
+ * run one program over several data images at once. Every lane is a machine
+ * of its own with the data, loop counters and loop detector of a single run;
+ * only the registers and PCs are kept across lanes, one vector per register.
+ * Each step runs the instruction at the lowest PC any lane is at, for all
+ * the lanes that are there, so lanes that go different ways at a branch wait
+ * for each other and carry on together once they meet again. A lane retires
+ * as soon as it stops, at exactly the point a run of its own would.
+ */
+template <class G>
+LOCKSTEP_CLONES void run_lockstep(BasicMachine<G> *const *lanes, int count,
+                                  const BasicMachine<G> &program,
+                                  Phase *results) {
+  // the engine only reads the program's copy, but each lane's report and
+  // profile need their own
+  for (int l = 0; l < count; l++) {
+    if (lanes[l] == &program) continue;
+    memcpy(lanes[l]->code, program.code, sizeof program.code);
+    memcpy(lanes[l]->decoded, program.decoded, sizeof program.decoded);
+  }
+#if LOCKSTEP_VECTORS
+  const DecodedInstr *decoded = program.decoded;
+  LaneWords regs[REGISTERS] = {};
+  LaneWords pcs = {};
+  LaneWords active_words;
+  uint16_t lane_registers[REGISTERS];
+  uint32_t live = 0;
+  uint32_t active;
+  uint32_t pc;
+
+  for (int l = 0; l < count; l++) {
+    for (int r = 0; r < REGISTERS; r++) {
+      regs[r][l] = lanes[l]->registers_general[r];
+    }
+    pcs[l] = lanes[l]->register_pc;
+    live |= 1u << l;
+  }
+
+// every lane in active
+#define FOR_ACTIVE(l) \
+  for (int l = 0; l < count; l++) if (active >> l & 1)
+
+// a lane's registers as one array, as the loop detector wants them
+#define GATHER(l)                                                \
+  do {                                                           \
+    for (int r = 0; r < REGISTERS; r++) {                        \
+      lane_registers[r] = regs[r][l];                            \
+    }                                                            \
+  } while (0)
+
+// hand the lane's state back so it can be reported like any other engine
+#define RETIRE(l, phase)                                         \
+  do {                                                           \
+    BasicMachine<G> &lane = *lanes[l];                           \
+    for (int r = 0; r < REGISTERS; r++) {                        \
+      lane.registers_general[r] = regs[r][l];                    \
+    }                                                            \
+    lane.register_pc = pcs[l];                                   \
+    lane.current_inst_raw = lane.register_pc < G::CODE_WORDS     \
+                                ? program.code[lane.register_pc] \
+                                : g_out_of_code_inst;            \
+    results[l] = (phase);                                        \
+    live &= ~(1u << l);                                          \
+    active &= ~(1u << l);                                        \
+  } while (0)
+
+// set the active lanes of the left register
+#define UPDATE(value)                                            \
+  do {                                                           \
+    left = ((value) & active_words) | (left & ~active_words);    \
+  } while (0)
+
+// register values pass through the same 6 bit sign extension as literals
+#define RIGHT_REGISTER() ((regs[d.right] ^ 0b100000) - 0b100000)
+
+#define BRANCH(comparison)                                       \
+  do {                                                           \
+    FOR_ACTIVE(l) {                                              \
+      lanes[l]->branch_taken = left[l] comparison regs[0][l];    \
+      lanes[l]->taken_counts[pc] += lanes[l]->branch_taken;      \
+      pcs[l] = lanes[l]->branch_taken ? d.target : pc + 1;       \
+    }                                                            \
+  } while (0)
+
+  while (live) {
+    // the lanes furthest behind go first
+    pc = 0x10000;
+    for (int l = 0; l < count; l++) {
+      if (live >> l & 1 && pcs[l] < pc) pc = pcs[l];
+    }
+    active = 0;
+    for (int l = 0; l < count; l++) {
+      if (live >> l & 1 && pcs[l] == pc) active |= 1u << l;
+    }
+
+    if (pc >= G::CODE_WORDS || decoded[pc].handler == ILLEGAL_HANDLER) {
+      FOR_ACTIVE(l) RETIRE(l, ILLEGAL_OPCODE);
+      continue;
+    }
+    FOR_ACTIVE(l) {
+      BasicMachine<G> &lane = *lanes[l];
+
+      if (lane.branch_taken) {
+        lane.branch_taken = false;
+        GATHER(l);
+        if (loop_detector_check(lane.loop_detector, pc, lane_registers,
+                                lane.data)) {
+          RETIRE(l, INFINITE_LOOP);
+          continue;
+        }
+      }
+      if (++lane.loop_counts[pc] > INFINITE_LOOP_TRIGGER_THRESHOLD) {
+        RETIRE(l, INFINITE_LOOP);
+      }
+    }
+    if (!active) continue;
+
+    const DecodedInstr &d = decoded[pc];
+    LaneWords &left = regs[d.left];
+    uint16_t literal = d.literal;
+
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+      active_words[l] = active >> l & 1 ? 0xFFFF : 0;
+    }
+    switch (d.handler) {
+      case ADD_LITERAL_HANDLER:
+        UPDATE(left + literal);
+        break;
+      case ADD_REGISTER_HANDLER:
+        UPDATE(left + RIGHT_REGISTER());
+        break;
+      case SUB_LITERAL_HANDLER:
+        UPDATE(left - literal);
+        break;
+      case SUB_REGISTER_HANDLER:
+        UPDATE(left - RIGHT_REGISTER());
+        break;
+      case AND_LITERAL_HANDLER:
+        UPDATE(left & literal);
+        break;
+      case AND_REGISTER_HANDLER:
+        UPDATE(left & RIGHT_REGISTER());
+        break;
+      case OR_LITERAL_HANDLER:
+        UPDATE(left | literal);
+        break;
+      case OR_REGISTER_HANDLER:
+        UPDATE(left | RIGHT_REGISTER());
+        break;
+      case XOR_LITERAL_HANDLER:
+        UPDATE(left ^ literal);
+        break;
+      case XOR_REGISTER_HANDLER:
+        UPDATE(left ^ RIGHT_REGISTER());
+        break;
+      case MOVE_LITERAL_HANDLER:
+        UPDATE((LaneWords){} + literal);
+        break;
+      case MOVE_LOAD_HANDLER:
+        // every lane has a data area of its own
+        FOR_ACTIVE(l) {
+          uint16_t address = regs[d.right][l];
+          const uint8_t *word;
+
+          if (address >= G::DATA_WORDS) {
+            RETIRE(l, ILLEGAL_ADDRESS);
+            continue;
+          }
+          word = lanes[l]->data.word(address);
+          left[l] =
+              sign_extend((word[0] << 8 & 0b111111110000000) | word[1], 6);
+        }
+        break;
+      case MOVE_STORE_LITERAL_HANDLER:
+      case MOVE_STORE_REGISTER_HANDLER:
+        FOR_ACTIVE(l) {
+          uint16_t address = left[l];
+          uint16_t word = d.handler == MOVE_STORE_LITERAL_HANDLER
+                              ? literal
+                              : sign_extend(regs[d.right][l], 6);
+          uint8_t *stored;
+
+          if (address >= G::DATA_WORDS) {
+            RETIRE(l, ILLEGAL_ADDRESS);
+            continue;
+          }
+          stored = lanes[l]->data.writable(address);
+          loop_detector_store(lanes[l]->loop_detector, address,
+                              loop_detector_word(stored), word);
+          // big endian
+          stored[0] = word >> 8;
+          stored[1] = word & 0xFF;
+        }
+        break;
+      case SHIFT_RIGHT_HANDLER:
+        UPDATE(left >> 1);
+        break;
+      case SHIFT_LEFT_HANDLER:
+        UPDATE(left << 1);
+        break;
+      case JR_HANDLER:
+        FOR_ACTIVE(l) {
+          pcs[l] = left[l] - 1;
+          lanes[l]->taken_counts[pc]++;
+          lanes[l]->branch_taken = true;
+        }
+        continue;
+      case BEQ_HANDLER:
+        BRANCH(==);
+        continue;
+      case BNE_HANDLER:
+        BRANCH(!=);
+        continue;
+      case BLT_HANDLER:
+        BRANCH(<);
+        continue;
+      case BGT_HANDLER:
+        BRANCH(>);
+        continue;
+      case BLE_HANDLER:
+        BRANCH(<=);
+        continue;
+      case BGE_HANDLER:
+        BRANCH(>=);
+        continue;
+    }
+    // everything but the branches goes on to the next instruction
+    FOR_ACTIVE(l) pcs[l] = pc + 1;
+  }
+
+#undef FOR_ACTIVE
+#undef GATHER
+#undef RETIRE
+#undef UPDATE
+#undef RIGHT_REGISTER
+#undef BRANCH
+#else
+  for (int l = 0; l < count; l++) results[l] = run_phases(*lanes[l]);
+#endif
+}
+
+/////////////////////////////////////////////////
+// general routines
+
+template <class G>
+void BasicMachine<G>::patch_data(uint16_t address, uint16_t word) {
+  uint8_t *stored = data.writable(address);
+
+  loop_detector_store(loop_detector, address, loop_detector_word(stored), word);
+  // big endian
+  stored[0] = word >> 8;
+  stored[1] = word & 0xFF;
+}
+
+template <class G>
+void BasicMachine<G>::reset_loop_detection() {
+  memset(loop_counts, 0, sizeof loop_counts);
+  memset(taken_counts, 0, sizeof taken_counts);
+  loop_detector_reset(loop_detector, data);
+  loaded_data = data;
+  branch_taken = false;
+}
+
+// initialise the code and the data array before loading data from file.
+template <class G>
+void BasicMachine<G>::reset() {
+  for (int i = 0; i < REGISTERS; i++) {
+    registers_general[i] = 0;
+  }
+  // start executing at location 0
+  register_pc = 0;
+  instruction_counter = 0;
+  data_words = 0;
+  load_error[0] = '\0';
+  data.clear();
+  memset(code, 0xFF, sizeof code);
+}
+
+template <class G>
+void BasicMachine<G>::print_memory(string &out, DumpFormat format) const {
+  // page by page, a paged area's untouched pages have nothing to diff and
+  // nothing for a sparse dump, the other forms show them as they read
+  for (int n = 0; n < DataArea::PAGES; n++) {
+    const uint8_t(*page)[WORD_SIZE] = data.page(n);
+    const uint8_t(*loaded)[WORD_SIZE] = loaded_data.page(n);
+    size_t first = (size_t)n * DataArea::PAGE_WORDS;
+
+    if (!page && (format == DIFF_DUMP || format == SPARSE_DUMP)) continue;
+    if (!page) page = BLANK_DATA_PAGE.words;
+    if (format == DIFF_DUMP) {
+      format_diff(page, loaded ? loaded : BLANK_DATA_PAGE.words,
+                  loop_detector.stored + first / 64, DataArea::PAGE_WORDS,
+                  first, out);
+    } else {
+      format_dump(page[0], DataArea::PAGE_WORDS * WORD_SIZE,
+                  first * WORD_SIZE, format, out);
+    }
+  }
+}
+
+// reads in the code file, or assembles it, and decodes it
+template <class G>
+bool BasicMachine<G>::load_code(const char *code_filename) {
+  load_error[0] = '\0';
+  if (is_assembly_source(code_filename)) {
+    vector<AssemblyLabel> labels;
+    string errors;
+
+    if (assemble_file(code_filename, code[0], sizeof code, labels, errors) <
+        0) {
+      // as much as fits, without the last newline
+      if (!errors.empty()) errors.pop_back();
+      snprintf(load_error, sizeof load_error, "%s", errors.c_str());
+      return false;
+    }
+    predecode_program(*this);
+    return true;
+  }
+
+  // mapped for straight binary access to the data
+  MappedFile code_file(code_filename);
+
+  // since we're allowing anything to be specified, make sure it's a file...
+  if (!code_file.is_open()) return false;
+
+  // put the code into the code area
+  memcpy(code, code_file.bytes(),
+         code_file.size() < sizeof code ? code_file.size() : sizeof code);
+
+  // decode everything up front so the run loop doesn't have to
+  predecode_program(*this);
+  return true;
+}
+
+// reads in the data file, a binary image or text
+template <class G>
+bool BasicMachine<G>::load_data(const char *data_filename) {
+  MappedFile data_file(data_filename);
+  TextError error;
+  bool image;
+  int capacity;
+
+  load_error[0] = '\0';
+  // since we're allowing anything to be specified, make sure it's a file...
+  if (!data_file.is_open()) return false;
+
+  // read through a buffer no bigger than what the file can hold, a word is
+  // two bytes of an image or four hex digits of text, so a big data area
+  // only gets the pages the file fills in
+  image = is_data_image(data_file.bytes(), data_file.size());
+  capacity = data_file.size() / (image ? WORD_SIZE : 2 * WORD_SIZE);
+  if (capacity > DATA_WORDS) capacity = DATA_WORDS;
+  unique_ptr<uint8_t[][WORD_SIZE]> words(new uint8_t[capacity][WORD_SIZE]);
+
+  if (image) {
+    if (!read_data_image(data_file.bytes(), data_file.size(), words.get(),
+                         capacity, data_words)) {
+      snprintf(load_error, sizeof load_error, "%s: damaged memory image",
+               data_filename);
+      return false;
+    }
+  } else if (!read_data_text(data_file.bytes(), data_file.size(), words.get(),
+                             capacity, data_words, error)) {
+    snprintf(load_error, sizeof load_error, "%s:%d:%d: %s", data_filename,
+             error.line, error.column, error.message);
+    return false;
+  }
+  data.write(0, data_words, words.get());
+  return true;
+}
+
+// reads in the file data and returns true is our code and data areas are
+// ready for processing
+template <class G>
+bool BasicMachine<G>::load(const char *code_filename,
+                           const char *data_filename) {
+  return load_code(code_filename) && load_data(data_filename);
+}
+
+template <class G>
+void BasicMachine<G>::report_stop(Phase current_phase, string &out) const {
+  char line[128];
+
+  // output what stopped the simulator
+  switch (current_phase) {
+    case ILLEGAL_OPCODE:
+      snprintf(line, sizeof line,
+               "Illegal instruction %02x%02x detected at address %04x\n\n",
+               /*better put some data here!*/ current_inst_raw[0],
+               current_inst_raw[1], register_pc);
+      out += line;
+      break;
+
+    case INFINITE_LOOP:
+      snprintf(line, sizeof line,
+               "Possible infinite loop detected with instruction %02x%02x at "
+               "address %04x\n\n",
+               /*better put some data here!*/ current_inst_raw[0],
+               current_inst_raw[1], register_pc);
+      out += line;
+      break;
+
+    case ILLEGAL_ADDRESS:
+      snprintf(line, sizeof line,
+               "Illegal address %04x detected with instruction %02x%02x at "
+               "address %04x\n\n",
+               /*better put some data here!*/ register_pc,
+               current_inst_raw[0], current_inst_raw[1], register_pc);
+      out += line;
+      break;
+
+    default:
+      break;
+  }
+}
+
+template <class G>
+void BasicMachine<G>::report(Phase current_phase, string &out) const {
+  report_stop(current_phase, out);
+  // print out the data area
+  print_memory(out);
+}
+
+template <class G>
+Phase BasicMachine<G>::run(const RunOptions &options) {
+  switch (options.engine) {
+    case THREADED_ENGINE:
+      return run_threaded(*this, options.fusion);
+    case JIT_ENGINE:
+      return run_jit(*this);
+    case LOCKSTEP_ENGINE: {
+      BasicMachine *lane = this;
+      Phase result;
+
+      run_lockstep(&lane, 1, *this, &result);
+      return result;
+    }
+    default:
+      return run_phases(*this);
+  }
+}
+
+template class BasicMachine<ClassicGeometry>;
+template class BasicMachine<LargeGeometry>;
+template void run_lockstep(Machine *const *lanes, int count,
+                           const Machine &program, Phase *results);
+template void run_lockstep(LargeMachine *const *lanes, int count,
+                           const LargeMachine &program, Phase *results);
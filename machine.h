@@ -0,0 +1,267 @@
+// One simulated processor and the engines that run it. A Machine holds its
+// registers, code and data, the decoded program and everything the engines
+// keep about a run, all in fixed size arrays. It shares nothing with other
+// machines, so it can be reset and reloaded without allocating, copied to
+// start many runs from one loaded image, and any number of them can run at
+// once on different threads.
+//
+// The sizes of the code and data areas are a template parameter (see
+// MachineGeometry in isa.h), so every array, bounds check and mask in the
+// engines is built for them. machine.cpp builds the classic 1K word
+// Machine and the 64K word LargeMachine. The LargeMachine's data area is
+// paged (see data_area.h), its pages are allocated as the program stores to
+// them.
+#ifndef MACHINE_H_
+#define MACHINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "data_area.h"
+#include "dump.h"
+#include "isa.h"
+#include "loop_detector.h"
+#include "trace.h"
+
+// how many times one instruction may run before we call it an infinite loop
+#define INFINITE_LOOP_TRIGGER_THRESHOLD (1024000)
+// how many programs the lockstep engine runs side by side, one uint16_t each
+// in an AVX2 vector
+#define LOCKSTEP_LANES 16
+
+// the ways we know how to run a program, selected with --engine
+enum ENGINES {
+  PHASE_ENGINE,     // the control unit state machine
+  THREADED_ENGINE,  // direct-threaded interpreter over the decoded program
+  JIT_ENGINE,       // native code for hot blocks, interpreter for the rest
+  LOCKSTEP_ENGINE,  // one program over many data images, in SIMD lanes
+  NUM_ENGINES
+};
+
+typedef enum ENGINES Engine;
+
+// We have specific phases that we use to execute each instruction.
+// We use this to run through a simple state machine that always advances to the
+// next state and then cycles back to the beginning.
+enum PHASES {
+  FETCH_INSTR,
+  DECODE_INSTR,
+  CALCULATE_EA,
+  FETCH_OPERANDS,
+  EXECUTE_INSTR,
+  WRITE_BACK,
+  NUM_PHASES,
+  // the following are error return codes that the state machine may return
+  ILLEGAL_OPCODE,   // indicates that we can't execute anymore instructions
+  INFINITE_LOOP,    // indicates that we think we have an infinite loop
+  ILLEGAL_ADDRESS,  // inidates that we have an memory location that's out of
+                    // range
+  PAUSED,           // stopped at a taken branch because pause was set, run()
+                    // again to carry on
+};
+
+typedef enum PHASES Phase;
+
+// what the threaded engine dispatches to at one address
+struct SUPERINSTRUCTION {
+  uint8_t handler;  // a superinstruction, or the plain handler
+  uint8_t length;   // instructions covered
+  int16_t addend;   // the ADD/SUB literal as an addition
+};
+
+typedef struct SUPERINSTRUCTION Superinstruction;
+
+// how to run a program
+struct RUN_OPTIONS {
+  Engine engine;
+  bool fusion;         // let the threaded engine use superinstructions
+  bool fusion_report;  // report them on the job's error output
+  bool profile;        // report where the time went, ditto
+  DumpFormat dump;     // how the job's output shows the data area
+};
+
+typedef struct RUN_OPTIONS RunOptions;
+
+template <class G>
+class BasicMachine {
+ public:
+  typedef G Geometry;
+  typedef DataAreaFor<G> DataArea;
+  static constexpr int CODE_WORDS = G::CODE_WORDS;
+  static constexpr int DATA_WORDS = G::DATA_WORDS;
+
+  BasicMachine() : trace(nullptr), pause(nullptr) { reset(); }
+
+  /**
+   * clear the registers, the PC and both memory areas, ready for a program
+   * to be loaded
+   */
+  void reset();
+
+  /**
+   * read a code file into the code area and decode it. A .asm file, or
+   * standard input for "-", is assembled straight into the code area.
+   * @return false if the file can't be read or doesn't assemble
+   */
+  bool load_code(const char *code_filename);
+
+  /**
+   * read a data file into the data area, either a binary image (see
+   * image.h) or text
+   * @return false if the file can't be read or is a damaged image
+   */
+  bool load_data(const char *data_filename);
+
+  /**
+   * read both files
+   * @return true if our code and data areas are ready for processing
+   */
+  bool load(const char *code_filename, const char *data_filename);
+
+  /**
+   * forget everything the loop detection has seen, must be called once the
+   * data area is loaded and before the program runs
+   */
+  void reset_loop_detection();
+
+  /**
+   * write one data word after the loop detection has been reset, keeping
+   * it up to date. A copy of a machine that is loaded and ready to run can
+   * be patched like this and run without reloading or resetting anything.
+   * @param address word address, must be below DATA_WORDS
+   * @param word the new value
+   */
+  void patch_data(uint16_t address, uint16_t word);
+
+  /**
+   * run the loaded program until the processor stops. The lockstep engine
+   * runs it as a single lane, see run_lockstep() for running several. Only
+   * the phase engine writes a trace. The phase, threaded and jit engines
+   * return PAUSED at the next taken branch once *pause is set, with the
+   * machine ready to carry on from there.
+   * @return the Phase that stopped the processor
+   */
+  Phase run(const RunOptions &options);
+
+  /**
+   * append what stopped the processor and the data area dump, the output
+   * of a simulator run
+   */
+  void report(Phase phase, std::string &out) const;
+
+  /**
+   * append just what stopped the processor, the first part of report()
+   */
+  void report_stop(Phase phase, std::string &out) const;
+
+  /**
+   * append the data area, in hexadecimal and ASCII form unless asked for
+   * another DumpFormat. A diff is against the data area as it was when the
+   * loop detection was reset.
+   */
+  void print_memory(std::string &out, DumpFormat format = HEX_DUMP) const;
+
+  /**
+   * append which superinstructions the last threaded run dispatched and how
+   * often, meant for stderr
+   */
+  void print_fusion_report(std::string &out) const;
+
+  /**
+   * append where the last run spent its time, meant for stderr: the hottest
+   * addresses, opcodes and basic blocks, and how the branches went
+   * @param labels a label for each code address, "" for none, or empty
+   */
+  void print_profile(std::string &out,
+                     const std::vector<std::string> &labels) const;
+
+  // The state of the machine, open to the engines.
+
+  uint16_t registers_general[REGISTERS];
+  uint16_t register_pc;
+
+  // memory for our code and data, using our word size for a second dimension
+  // to make accessing bytes easier
+  uint8_t code[CODE_WORDS][WORD_SIZE];
+  DataArea data;
+  int data_words;  // how much of the data area the data file filled in
+  char load_error[192];  // why loading failed, if it could tell
+  // the data area as reset_loop_detection() found it, for diff dumps
+  DataArea loaded_data;
+
+  // the decoded form of every word in the code area, see predecode_program()
+  DecodedInstr decoded[CODE_WORDS];
+
+  // the threaded engine's view of the program, see fuse_program()
+  Superinstruction superinstructions[CODE_WORDS];
+
+  // the instruction going through the control unit
+  const uint8_t *current_inst_raw;
+  const DecodedInstr *current_decoded;
+  uint16_t *current_operand_left;
+  uint16_t *current_operand_right;
+  bool current_operand_right_need_fetch;
+  int16_t current_operand_right_fetched;
+
+  // Infinite loops are caught when the machine state repeats at a branch
+  // target (see loop_detector.h). Counting executions per PC stays as a
+  // budget for loops too long for the detector. One extra slot so the
+  // threaded engine can count running off the end of the code.
+  int32_t loop_counts[CODE_WORDS + 1];
+  // how often the branch or JR at each address was taken, which together
+  // with loop_counts is all a profile needs
+  int32_t taken_counts[CODE_WORDS];
+  BasicLoopDetector<DataArea> loop_detector;
+  // the last instruction took a branch, so the next one is a branch target
+  bool branch_taken;
+
+  int64_t instruction_counter;  // instructions traced so far
+
+  // where the phase engine records every instruction it runs, or nullptr.
+  // Not touched by reset(), the caller owns the writer.
+  TraceWriter *trace;
+
+  // set to nonzero, from any thread, to have run() return PAUSED, or
+  // nullptr. Not touched by reset() either.
+  std::atomic<uint16_t> *pause;
+};
+
+// the classic machine, 1K words of code and data
+typedef BasicMachine<ClassicGeometry> Machine;
+// every address a program can reach, 64K words of each
+typedef BasicMachine<LargeGeometry> LargeMachine;
+
+// both are built in machine.cpp
+extern template class BasicMachine<ClassicGeometry>;
+extern template class BasicMachine<LargeGeometry>;
+
+/**
+ * append the assembly form of an instruction, as in "ADD R1,R2"
+ * @param raw the instruction word, big endian
+ */
+void format_instruction(const uint8_t *raw, std::string &out);
+
+/**
+ * run one program over several data images at once with the lockstep engine.
+ * Every lane is a machine of its own with the data loaded and its loop
+ * detection reset; the program is copied into each before the run, so every
+ * lane can be reported and profiled like a machine that ran alone.
+ * @param lanes the machines, at most LOCKSTEP_LANES
+ * @param count number of lanes
+ * @param program the machine holding the loaded and decoded program, may be
+ *                one of the lanes
+ * @param results the Phase that stopped each lane
+ */
+template <class G>
+void run_lockstep(BasicMachine<G> *const *lanes, int count,
+                  const BasicMachine<G> &program, Phase *results);
+
+extern template void run_lockstep(Machine *const *lanes, int count,
+                                  const Machine &program, Phase *results);
+extern template void run_lockstep(LargeMachine *const *lanes, int count,
+                                  const LargeMachine &program,
+                                  Phase *results);
+
+#endif  // MACHINE_H_
@@ -0,0 +1,87 @@
+// A whole file mapped read-only into memory. Where there is no mmap the file
+// is read into a buffer instead, so callers only ever see a block of bytes.
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#if !defined(_WIN32)
+#define MAPPED_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define MAPPED_FILE_MMAP 0
+#endif
+
+class MappedFile {
+ public:
+  /**
+   * map a file, check is_open() to see if that worked
+   */
+  explicit MappedFile(const char *filename)
+      : open_(false), bytes_(nullptr), size_(0) {
+#if MAPPED_FILE_MMAP
+    int fd = open(filename, O_RDONLY);
+    struct stat status;
+
+    if (fd < 0) return;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode)) {
+      size_ = status.st_size;
+      open_ = true;
+      // an empty file can't be mapped, but it is still a file
+      if (size_ > 0) {
+        void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapped == MAP_FAILED) {
+          open_ = false;
+          size_ = 0;
+        } else {
+          bytes_ = static_cast<const uint8_t *>(mapped);
+        }
+      }
+    }
+    close(fd);
+#else
+    FILE *file = fopen(filename, "rb");
+    uint8_t block[4096];
+    size_t got;
+
+    if (!file) return;
+    while ((got = fread(block, 1, sizeof block, file)) > 0) {
+      buffer_.insert(buffer_.end(), block, block + got);
+    }
+    fclose(file);
+    open_ = true;
+    bytes_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+  }
+
+  ~MappedFile() {
+#if MAPPED_FILE_MMAP
+    if (bytes_) munmap(const_cast<uint8_t *>(bytes_), size_);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool is_open() const { return open_; }
+  const uint8_t *bytes() const { return bytes_; }
+  size_t size() const { return size_; }
+
+ private:
+  bool open_;
+  const uint8_t *bytes_;  // nullptr for an empty file
+  size_t size_;
+#if !MAPPED_FILE_MMAP
+  std::vector<uint8_t> buffer_;
+#endif
+};
+
+#endif  // MAPPED_FILE_H_
@@ -1,586 +1,717 @@
-#include <cstdint>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
-#include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include "assemble.h"
+#include "checkpoint.h"
+#include "dump.h"
+#include "image.h"
+#include "machine.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 
 using namespace std;
 
-#define LINE_LENGTH 16
-
-// constants for our processor definition (sizes are in words)
-#define WORD_SIZE 2
-#define DATA_SIZE 1024
-#define CODE_SIZE 1024
-#define REGISTERS 16
-#define INFINITE_LOOP_TRIGGER_THRESHOLD (1024000)
-
-///////////////////////////////////////////////
-// constants and structures
-static uint16_t registers_general[REGISTERS];
-static uint16_t register_pc;
-
-// our opcodes are nicely incremental
-enum OPCODES {
-  ADD_OPCODE,
-  SUB_OPCODE,
-  AND_OPCODE,
-  OR_OPCODE,
-  XOR_OPCODE,
-  MOVE_OPCODE,
-  SHIFT_OPCODE,
-  BRANCH_OPCODE,
-  NUM_OPCODES
+// the names of the engines for --engine, in the order of ENGINES
+const static char *ENGINES_STR[]{"phase", "threaded", "jit", "lockstep"};
+// the names of the dump formats for --dump, in the order of DUMP_FORMATS
+const static char *DUMP_FORMATS_STR[]{"hex", "raw", "diff", "sparse"};
+
+// a data word written over the base image before a forked run
+struct DATA_PATCH {
+  uint16_t address;
+  uint16_t word;
 };
 
-typedef enum OPCODES Opcode;
+typedef struct DATA_PATCH DataPatch;
 
-// ------------------------------debug----------------
+// one program to run and what it printed
+struct JOB {
+  string code_filename;
+  string data_filename;
+  vector<DataPatch> patches;  // for a job forked from the base image
+  string output_filename;     // empty to print with the rest of the batch
+  string output;           // the stop reason and memory dump
+  string errors;           // anything meant for stderr
+};
 
-const static char *OPCODES_STR[]{"ADD",  "SUB",   "AND",    "OR", "XOR",
-                                 "MOVE", "SHIFT", "BRANCH", "NUM"};
+typedef struct JOB Job;
 
-const static char *OPCODES_BRANCH_STR[]{
-    "JR", "BEQ", "BNE", "BLT", "BGT", "BLE", "BGE",
+// checkpointing asked for on the command line
+struct CHECKPOINTING {
+  const char *filename;          // where to write checkpoints, or NULL
+  double period;                 // seconds between them
+  const char *restore_filename;  // the checkpoint to carry on from, or NULL
 };
 
-// ---------------------------------------------------
-
-// We have specific phases that we use to execute each instruction.
-// We use this to run through a simple state machine that always advances to the
-// next state and then cycles back to the beginning.
-enum PHASES {
-  FETCH_INSTR,
-  DECODE_INSTR,
-  CALCULATE_EA,
-  FETCH_OPERANDS,
-  EXECUTE_INSTR,
-  WRITE_BACK,
-  NUM_PHASES,
-  // the following are error return codes that the state machine may return
-  ILLEGAL_OPCODE,   // indicates that we can't execute anymore instructions
-  INFINITE_LOOP,    // indicates that we think we have an infinite loop
-  ILLEGAL_ADDRESS,  // inidates that we have an memory location that's out of
-                    // range
-};
+typedef struct CHECKPOINTING Checkpointing;
 
-typedef enum PHASES Phase;
-
-// standard function pointer to run our control unit state machine
-typedef Phase (*process_phase)(void);
-
-///////////////////////////////////////////////
-// prototypes
-Phase fetch_instr();
-
-Phase decode_instr();
-
-Phase detecting_infinite_loop();
-
-Phase fetch_operands();
-
-Phase execute_instr();
-
-Phase write_back();
-
-////////////////////////////////////////////////
-// local variables
-
-static uint8_t *g_current_inst_raw;
-static uint8_t g_current_inst;
-static uint16_t *g_current_operand_left;
-static uint16_t *g_current_operand_right;
-static bool g_current_operand_right_need_fetch;
-static int16_t g_current_operand_right_fetched;
-
-static map<uint16_t, int32_t> g_infinite_loop_detect_map;
-
-// memory for our code and data, using our word size for a second dimension to
-// make accessing bytes easier
-static uint8_t code[CODE_SIZE][WORD_SIZE];
-static uint8_t data[DATA_SIZE][WORD_SIZE];
-
-// A list of handlers to process each state. Provides for a nice simple
-// state machine loop and is easily extended without using a huge
-// switch statement.
-static process_phase control_unit[NUM_PHASES] = {
-    fetch_instr,    decode_instr,  detecting_infinite_loop,
-    fetch_operands, execute_instr, write_back};
-
-static int64_t g_instruction_counter = 0;
-void print_inst(uint8_t inst, uint8_t left, uint8_t right) {
-  stringstream instruction;
-  int operand_left = static_cast<int>(left);
-  int operand_right = static_cast<int>(right);
-  auto opcode_category = inst >> 3 & 0b111;
-  auto opcode_type = inst & 0b111;
-  switch (opcode_category) {
-    case SHIFT_OPCODE:
-      // 110 is used to identify a shift operation.
-      // The remaining 3 bits are used to identify direction,
-      // with 000 indicating right and 001 indicating left.
-      if (opcode_type == 0) {
-        instruction << "SRR";
-      } else if (opcode_type == 1) {
-        instruction << "SRL";
-      }
-      break;
-    case BRANCH_OPCODE:
-      // Each operation will have the following format:
-      // 111    xxx    _ _ _ _     _ _ _ _ _ _
-      // The operation value assignments are:
-      // • 000: JR (note that operand 2 will contain all zeros)
-      // • 001: BEQ
-      // • 010: BNE
-      // • 011: BLT
-      // • 100: BGT
-      // • 101: BLE
-      // • 110: BGE
-      if (opcode_type < 0b111) {
-        instruction << OPCODES_BRANCH_STR[opcode_type];
-      }
-      break;
-    default:
-      instruction << OPCODES_STR[opcode_category];
+// the run being checkpointed, for the signal handlers
+static CheckpointControl *volatile g_checkpoint = nullptr;
+
+// exit status of a run that was stopped and can carry on from its checkpoint
+#define EXIT_PREEMPTED 3
+
+/**
+ * note a job whose files couldn't be read
+ * @param m the machine that tried, for a more precise reason if it has one
+ */
+template <class M>
+void load_failed(const M &m, Job &job) {
+  job.errors += "cannot load " + job.code_filename + " and " +
+                job.data_filename + "\n";
+  if (m.load_error[0]) job.errors += string(m.load_error) + "\n";
+}
+
+/**
+ * get a machine ready to run a job. Without a base image the job's files are
+ * loaded from scratch; with one, the machine becomes a copy of the base and
+ * only the job's patches are applied.
+ * @param base a machine loaded and ready to run, or nullptr
+ * @return false if the job's files can't be read
+ */
+template <class M>
+bool prepare_job(M &m, Job &job, const M *base) {
+  if (base) {
+    m = *base;
+    for (auto &patch : job.patches) m.patch_data(patch.address, patch.word);
+    return true;
   }
-  instruction << " ";
-
-  switch (opcode_category) {
-    case MOVE_OPCODE:
-      if (opcode_type == 0) {
-        // 000: literal to register with format:
-        instruction << "R" << operand_left << "," << operand_right;
-      } else if (opcode_type == 1) {
-        // 001: memory to register with format:
-        instruction << "R" << operand_left << ","
-                    << "[R" << (operand_right >> 2 & 0b1111) << "]";
-      } else if (opcode_type == 0b100) {
-        // 100: literal to memory with format:
-        instruction << "[R" << operand_left << "]," << operand_right;
-      } else if (opcode_type == 0b101) {
-        // 101: register to memory with format:
-        instruction << "[R" << operand_left << "],R"
-                    << (operand_right >> 2 & 0b1111);
-      }
-      break;
-    case SHIFT_OPCODE:
-      instruction << "R" << operand_left;
-      break;
-    case BRANCH_OPCODE:
-      instruction << "R" << operand_left;
-      if (opcode_type != 0) {
-        instruction << "," << operand_right;
-      }
-      break;
-    default:
-      if (opcode_type == 0) {
-        // xxx    000    _ _ _ _    _ _ _ _ _ _
-        instruction << "R" << operand_left << "," << operand_right;
-      } else if (opcode_type == 1) {
-        // xxx    001    _ _ _ _    _ _ _ _ 0 0
-        instruction << "R" << operand_left << ",R"
-                    << (operand_right >> 2 & 0b1111);
-      }
+  m.reset();
+
+  // read in our code and data
+  if (!m.load(job.code_filename.c_str(), job.data_filename.c_str())) {
+    load_failed(m, job);
+    return false;
   }
-  string a = instruction.str();
-  cout << "#" << g_instruction_counter << "\tPC: " << register_pc
-       << "\tINST: " << a << "\n";
-  g_instruction_counter++;
+  m.reset_loop_detection();
+  return true;
 }
 
-/////////////////////////////////////////////////
-// state processing routines
 /**
- * fetching instruction from code section (code array)
- * @return Phase enum
+ * read the labels the assembler wrote next to a code file: foo.sym for
+ * foo.o, lines of a hex word address and a label. A .asm file is assembled
+ * again for its labels; standard input has none.
+ * @param code_words size of the code area the program was loaded into
+ * @param labels set to a label for each code address, left empty if there
+ *               is no symbol file
  */
-Phase fetch_instr() {
-  g_current_inst_raw = code[register_pc];
-  return DECODE_INSTR;
+void read_symbols(const string &code_filename, int code_words,
+                  vector<string> &labels) {
+  size_t dot = code_filename.rfind('.');
+  std::ifstream symbols;
+  unsigned address;
+  string label;
+
+  labels.clear();
+  if (code_filename != "-" && is_assembly_source(code_filename.c_str())) {
+    vector<uint8_t> code(code_words * WORD_SIZE);
+    vector<AssemblyLabel> assembled;
+    string errors;
+
+    if (assemble_file(code_filename.c_str(), code.data(), code.size(),
+                      assembled, errors) < 0) {
+      return;
+    }
+    labels.resize(code_words);
+    for (auto &assembled_label : assembled) {
+      if (assembled_label.address < code_words) {
+        labels[assembled_label.address] = assembled_label.name;
+      }
+    }
+    return;
+  }
+  if (dot == string::npos) return;
+  symbols.open(code_filename.substr(0, dot) + ".sym");
+  if (!symbols.is_open()) return;
+  labels.resize(code_words);
+  while (symbols >> std::hex >> address >> label) {
+    if (address < (unsigned)code_words) labels[address] = label;
+  }
 }
 
 /**
- * sign extending for arbitrary digits of integer
- * @param x number to be extended
- * @param bits digits
- * @return extended number
+ * fill in a finished job's output. A raw dump is nothing but the data area,
+ * so the stop reason goes with the errors instead.
+ * @param labels the labels for the profile, or nullptr to read them for the
+ *               job's code file
  */
-int16_t sign_extend(uint16_t x, int bits) {
-  uint16_t m = 1u << (bits - 1);
-  return (x ^ m) - m;
+template <class M>
+void report_job(const M &m, Phase phase, Job &job, const RunOptions &options,
+                const vector<string> *labels = nullptr) {
+  if (options.profile) {
+    vector<string> read;
+
+    if (!labels) {
+      read_symbols(job.code_filename, M::CODE_WORDS, read);
+      labels = &read;
+    }
+    m.print_profile(job.errors, *labels);
+  }
+  m.report_stop(phase, options.dump == RAW_DUMP ? job.errors : job.output);
+  m.print_memory(job.output, options.dump);
 }
 
 /**
- * decode instruction so that later phase can use
- * @return Phase enum
+ * run one program from loading it to the memory dump
+ * @param m the machine to run it on, reset first
+ * @param job what to run, its output and errors are filled in
+ * @param options the engine to use
+ * @param base the image to fork the job from, or nullptr
  */
-Phase decode_instr() {
-  // big endian
-  auto &l = g_current_inst_raw[0];
-  auto &r = g_current_inst_raw[1];
-  g_current_inst = l >> 2 & 0b111111;
-  auto opcode_category = g_current_inst >> 3 & 0b111;
-  auto opcode_type = g_current_inst & 0b111;
-
-  g_current_operand_left =
-      &registers_general[l << 2 & 0b1100 | (r >> 6 & 0b11)];
-  //  g_current_operand_right = r & 0b111111;
-  switch (opcode_category) {
-    case MOVE_OPCODE:
-      if (opcode_type == 1) {
-        g_current_operand_right = &registers_general[r >> 2 & 0b1111];
-        g_current_operand_right_need_fetch = true;
-      } else if (opcode_type == 0b101) {
-        g_current_operand_right = &registers_general[r >> 2 & 0b1111];
-        g_current_operand_right_need_fetch = false;
-        g_current_operand_right_fetched = *g_current_operand_right;
-      } else if (opcode_type == 0 || opcode_type == 0b100) {
-        g_current_operand_right = nullptr;
-        g_current_operand_right_need_fetch = false;
-        g_current_operand_right_fetched = r & 0b111111;
-      } else {
-        return ILLEGAL_OPCODE;
-      }
-      break;
-    case ADD_OPCODE:
-    case SUB_OPCODE:
-    case AND_OPCODE:
-    case OR_OPCODE:
-    case XOR_OPCODE:
-      if (opcode_type == 0) {
-        g_current_operand_right = nullptr;
-        g_current_operand_right_need_fetch = false;
-        g_current_operand_right_fetched = r & 0b111111;
-      } else if (opcode_type == 1) {
-        g_current_operand_right = &registers_general[r >> 2 & 0b1111];
-        g_current_operand_right_need_fetch = false;
-        g_current_operand_right_fetched = *g_current_operand_right;
-      } else {
-        return ILLEGAL_OPCODE;
-      }
-      break;
-    case BRANCH_OPCODE: {
-      g_current_operand_right = nullptr;
-      g_current_operand_right_need_fetch = false;
-      // g_current_operand_right_fetched = sign_extend(r & 0b111111, 6);
-      break;
-    }
-    default:
-      g_current_operand_right = nullptr;
-      g_current_operand_right_need_fetch = false;
-      g_current_operand_right_fetched = r & 0b111111;
+template <class M>
+void run_job(M &m, Job &job, const RunOptions &options, const M *base) {
+  Phase current_phase;
+
+  if (!prepare_job(m, job, base)) return;
+
+  // run our simulator
+  current_phase = m.run(options);
+  if (options.engine == THREADED_ENGINE && options.fusion_report) {
+    m.print_fusion_report(job.errors);
   }
-  // debug only, print the instruction that will be execute
-  // print_inst(g_current_inst, (l << 2 & 0b1100) | (r >> 6 & 0b11), r &
-  // 0b111111);
-  return CALCULATE_EA;
+  report_job(m, current_phase, job, options);
 }
 
 /**
- * detecting infinite loop
- * @return Phase enum
+ * run jobs that share a code file with the lockstep engine. The program is
+ * loaded and decoded once, then every job gets a lane with its own data.
+ * @param machines LOCKSTEP_LANES machines to run the lanes on
+ * @param jobs the jobs, at most LOCKSTEP_LANES
+ * @param count number of jobs
+ * @param options how to report the jobs
+ * @param base the image to fork the jobs from, or nullptr
  */
-Phase detecting_infinite_loop() {
-  // detecting infinite loop
-  if (g_infinite_loop_detect_map.find(register_pc) ==
-      g_infinite_loop_detect_map.end()) {
-    g_infinite_loop_detect_map[register_pc] = 0;
+template <class M>
+void run_lockstep_jobs(M *const *machines, Job *const *jobs, int count,
+                       const RunOptions &options, const M *base) {
+  M *lanes[LOCKSTEP_LANES];
+  Job *lane_jobs[LOCKSTEP_LANES];
+  Phase results[LOCKSTEP_LANES];
+  int lane_count = 0;
+
+  // the first machine keeps the program even if its own job can't be loaded
+  if (!base) {
+    machines[0]->reset();
+    if (!machines[0]->load_code(jobs[0]->code_filename.c_str())) {
+      for (int i = 0; i < count; i++) load_failed(*machines[0], *jobs[i]);
+      return;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    M &m = *machines[i];
+
+    if (base) {
+      prepare_job(m, *jobs[i], base);
+    } else {
+      if (i > 0) m.reset();
+      if (!m.load_data(jobs[i]->data_filename.c_str())) {
+        load_failed(m, *jobs[i]);
+        continue;
+      }
+      m.reset_loop_detection();
+    }
+    lanes[lane_count] = &m;
+    lane_jobs[lane_count++] = jobs[i];
   }
-  g_infinite_loop_detect_map[register_pc] += 1;
-  if (g_infinite_loop_detect_map[register_pc] >
-      INFINITE_LOOP_TRIGGER_THRESHOLD) {
-    return INFINITE_LOOP;
+  if (lane_count == 0) return;
+
+  run_lockstep(lanes, lane_count, base ? *base : *machines[0], results);
+  for (int l = 0; l < lane_count; l++) {
+    report_job(*lanes[l], results[l], *lane_jobs[l], options);
   }
-  return FETCH_OPERANDS;
 }
 
 /**
- * fetch from memory (data array)
- * @return Phase enum
+ * read a batch manifest. Every line names a code file, a data file and
+ * optionally a file for the output; blank lines and lines starting with #
+ * are skipped.
+ * @return false if the manifest can't be read or a line is incomplete
  */
-Phase fetch_operands() {
-  if (g_current_operand_right_need_fetch) {
-    if (*g_current_operand_right >= DATA_SIZE || *g_current_operand_right < 0) {
-      return ILLEGAL_ADDRESS;
+bool read_manifest(const char *filename, vector<Job> &jobs) {
+  std::ifstream manifest(filename);
+  string line;
+  int line_number = 0;
+
+  if (!manifest.is_open()) {
+    fprintf(stderr, "cannot open manifest %s\n", filename);
+    return false;
+  }
+  while (getline(manifest, line)) {
+    istringstream fields(line);
+    Job job;
+
+    line_number++;
+    if (!(fields >> job.code_filename) || job.code_filename[0] == '#')
+      continue;
+    if (!(fields >> job.data_filename)) {
+      fprintf(stderr, "%s:%d: expected <code.o> <memory.dat> [output]\n",
+              filename, line_number);
+      return false;
     }
-    auto d = data[*g_current_operand_right];
-    g_current_operand_right_fetched = (d[0] << 8 & 0b111111110000000) | d[1];
+    fields >> job.output_filename;
+    jobs.push_back(job);
   }
-  g_current_operand_right_fetched =
-      sign_extend(g_current_operand_right_fetched, 6);
-  return EXECUTE_INSTR;
+  return true;
 }
 
 /**
- * executing decoded instruction
- * @return Phase enum
+ * read the patches for a fork run. Every line is one job on top of the base
+ * image: any number of address=word pairs in hex, and optionally a file for
+ * the output. Blank lines and lines starting with # are skipped.
+ * @param code_filename the base image's code file, to name the jobs
+ * @param data_filename the base image's data file
+ * @param data_words size of the base image's data area
+ * @return false if the manifest can't be read or a patch is out of range
  */
-Phase execute_instr() {
-  auto opcode_category = g_current_inst >> 3 & 0b111;
-  auto opcode_type = g_current_inst & 0b111;
-  bool is_jumped = false;
-  switch (opcode_category) {
-    case ADD_OPCODE:
-      *g_current_operand_left += g_current_operand_right_fetched;
-      break;
-    case SUB_OPCODE:
-      *g_current_operand_left -= g_current_operand_right_fetched;
-      break;
-    case AND_OPCODE:
-      *g_current_operand_left &= g_current_operand_right_fetched;
-      break;
-    case OR_OPCODE:
-      *g_current_operand_left |= g_current_operand_right_fetched;
-      break;
-    case XOR_OPCODE:
-      *g_current_operand_left ^= g_current_operand_right_fetched;
-      break;
-    case MOVE_OPCODE:
-      if (opcode_type == 0b100 || opcode_type == 0b101) {
-        auto offset = *g_current_operand_left;
-        if (offset >= 0 && offset < DATA_SIZE) {
-          // big endian
-          data[offset][0] = g_current_operand_right_fetched >> 8 & 0xFF;
-          data[offset][1] = g_current_operand_right_fetched & 0xFF;
-        } else {
-          return ILLEGAL_ADDRESS;
+bool read_patches(const char *filename, const char *code_filename,
+                  const char *data_filename, int data_words,
+                  vector<Job> &jobs) {
+  std::ifstream manifest(filename);
+  string line;
+  string field;
+  int line_number = 0;
+
+  if (!manifest.is_open()) {
+    fprintf(stderr, "cannot open manifest %s\n", filename);
+    return false;
+  }
+  while (getline(manifest, line)) {
+    istringstream fields(line);
+    Job job;
+
+    line_number++;
+    if (!(fields >> field) || field[0] == '#') continue;
+    job.code_filename = code_filename;
+    job.data_filename = data_filename;
+    do {
+      unsigned address;
+      unsigned word;
+      int used = 0;
+
+      if (sscanf(field.c_str(), "%x=%x%n", &address, &word, &used) == 2 &&
+          used == (int)field.size()) {
+        if (address >= (unsigned)data_words || word > 0xFFFF) {
+          fprintf(stderr, "%s:%d: %s is outside the data area\n", filename,
+                  line_number, field.c_str());
+          return false;
         }
-      } else if (opcode_type == 0 || opcode_type == 1) {
-        *g_current_operand_left = g_current_operand_right_fetched;
+        job.patches.push_back({(uint16_t)address, (uint16_t)word});
       } else {
-        return ILLEGAL_OPCODE;
-      }
-      break;
-    case SHIFT_OPCODE:
-      if (opcode_type == 0)
-        *g_current_operand_left >>= 1;
-      else if (opcode_type == 1)
-        *g_current_operand_left <<= 1;
-      else
-        return ILLEGAL_OPCODE;
-      break;
-    case BRANCH_OPCODE:
-      switch (opcode_type) {
-        case 0:  // JR direct jump
-          register_pc = *g_current_operand_left - 1;
-          is_jumped = true;
-          break;
-        case 1:  // BEQ
-          if (*g_current_operand_left == registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        case 2:  // BNE
-          if (*g_current_operand_left != registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        case 3:  // BLT
-          if (*g_current_operand_left < registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        case 4:  // BGT
-          if (*g_current_operand_left > registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        case 5:  // BLE
-          if (*g_current_operand_left <= registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        case 6:  // BGE
-          if (*g_current_operand_left >= registers_general[0]) {
-            register_pc += g_current_operand_right_fetched;
-            is_jumped = true;
-          }
-          break;
-        default:
-          return ILLEGAL_OPCODE;
+        job.output_filename = field;
       }
-      break;
-    default:
-      return ILLEGAL_OPCODE;
+    } while (fields >> field);
+    jobs.push_back(job);
   }
-  if (opcode_category != BRANCH_OPCODE || !is_jumped) register_pc++;
-  return WRITE_BACK;
+  return true;
 }
 
 /**
- * not used here
- * @return Phase enum
+ * hand a finished job's output to its file, or to stdout with a header naming
+ * the job, and its errors to stderr
+ * @return false if the output file can't be written
  */
-Phase write_back() { return FETCH_INSTR; }
-
-/////////////////////////////////////////////////
-// general routines
+bool write_job(const Job &job, bool batch) {
+  FILE *out = stdout;
+  bool rc = true;
+
+  fwrite(job.errors.data(), 1, job.errors.size(), stderr);
+  if (!job.output_filename.empty()) {
+    out = fopen(job.output_filename.c_str(), "wb");
+    if (!out) {
+      fprintf(stderr, "cannot write %s\n", job.output_filename.c_str());
+      return false;
+    }
+  } else if (batch) {
+    printf("==> %s %s", job.code_filename.c_str(), job.data_filename.c_str());
+    for (auto &patch : job.patches) {
+      printf(" %04x=%04x", patch.address, patch.word);
+    }
+    printf(" <==\n");
+  }
+  // the dump is by far the biggest part, it goes out in one write
+  fflush(out);
+  rc = write_all(fileno(out), job.output.data(), job.output.size());
+  if (out != stdout) rc = fclose(out) == 0 && rc;
+  return rc;
+}
 
 /**
- * initialise the code and the data array before loading data from file.
+ * split a batch into the pieces a worker runs in one go. That is one job at a
+ * time, except for the lockstep engine which takes up to LOCKSTEP_LANES jobs
+ * with the same code file.
  */
-void initialize_system() {
-  for (int i = 0; i <= REGISTERS; i++) {
-    registers_general[i] = 0;
+vector<vector<size_t>> plan_batch(const vector<Job> &jobs,
+                                  const RunOptions &options) {
+  vector<vector<size_t>> tasks;
+  map<string, size_t> filling;  // code file to the task taking more of its jobs
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (options.engine != LOCKSTEP_ENGINE) {
+      tasks.push_back(vector<size_t>(1, i));
+      continue;
+    }
+    auto task = filling.find(jobs[i].code_filename);
+    if (task == filling.end() || tasks[task->second].size() == LOCKSTEP_LANES) {
+      filling[jobs[i].code_filename] = tasks.size();
+      tasks.push_back(vector<size_t>());
+      task = filling.find(jobs[i].code_filename);
+    }
+    tasks[task->second].push_back(i);
   }
-  // start executing at location 0
-  register_pc = 0;
-  memset(data, 0xFF, sizeof data);
-  memset(code, 0xFF, sizeof code);
+  return tasks;
 }
 
-// checks the hex value to ensure it a printable ASCII character. If
-// it isn't, '.' is returned instead of itself
-char valid_ascii(unsigned char hex_value) {
-  if (hex_value < 0x21 || hex_value > 0x7e) hex_value = '.';
+/**
+ * run every job of a batch on a thread pool, with machines of its own for
+ * every worker. Outputs are written in manifest order as soon as all the jobs
+ * before them are done, so nothing depends on which thread ran what.
+ * @param workers threads to use, 0 for all hardware threads
+ * @param base the image to fork every job from, or nullptr
+ * @return the exit status
+ */
+template <class M>
+int run_batch(vector<Job> &jobs, const RunOptions &options, unsigned workers,
+              const M *base) {
+  ThreadPool pool(workers);
+  vector<vector<size_t>> tasks = plan_batch(jobs, options);
+  int lanes = options.engine == LOCKSTEP_ENGINE ? LOCKSTEP_LANES : 1;
+  vector<unique_ptr<M>> machines(pool.workers() * lanes);
+  vector<char> done(jobs.size(), false);
+  std::mutex output_lock;
+  size_t next_output = 0;
+  bool rc = true;
+
+  for (auto &machine : machines) machine.reset(new M);
+  pool.run(tasks.size(), [&](unsigned worker, size_t index) {
+    const vector<size_t> &task = tasks[index];
+    M *lane_machines[LOCKSTEP_LANES];
+    Job *lane_jobs[LOCKSTEP_LANES];
+
+    for (size_t i = 0; i < task.size(); i++) {
+      lane_machines[i] = machines[worker * lanes + i].get();
+      lane_jobs[i] = &jobs[task[i]];
+    }
+    if (options.engine == LOCKSTEP_ENGINE) {
+      run_lockstep_jobs(lane_machines, lane_jobs, task.size(), options, base);
+    } else {
+      run_job(*lane_machines[0], *lane_jobs[0], options, base);
+    }
 
-  return (char)hex_value;
+    std::lock_guard<std::mutex> guard(output_lock);
+    for (size_t i : task) done[i] = true;
+    while (next_output < jobs.size() && done[next_output]) {
+      Job &job = jobs[next_output++];
+      rc = write_job(job, true) && rc;
+      // the output is written, don't hold on to it for the rest of the batch
+      string().swap(job.output);
+      string().swap(job.errors);
+    }
+  });
+  fflush(stdout);
+  return rc ? 0 : 1;
 }
 
-// takes the data and prints it out in hexadecimal and ASCII form
-void print_formatted_data(unsigned char *data, int length) {
-  int i, j, k;
-  char the_text[LINE_LENGTH + 1];
-
-  // print each line 1 at a time
-  for (i = 0; i < length; i += LINE_LENGTH) {
-    printf("%08x  ", i);
-    // add 1 word at a time, but don't go beyond the end of the data
-    for (j = 0; j < LINE_LENGTH && (i + j) < length; j += 2) {
-      the_text[j] = valid_ascii(data[i + j]);
-      the_text[j + 1] = valid_ascii(data[i + j + 1]);
-      printf("%02x %02x ", data[i + j], data[i + j + 1]);
-    }
+/**
+ * convert a data file from the text form to a binary image, or from a binary
+ * image back to text
+ * @return the exit status
+ */
+template <class M>
+int convert_data(const char *from, const char *to) {
+  unique_ptr<M> machine(new M);
+  bool to_text;
+  bool rc;
 
-    // add in FFFF (invalid operation) to fill out the line
-    if ((i + j) >= length) {
-      for (k = j; k < LINE_LENGTH; k += 2) {
-        the_text[k] = valid_ascii(0xff);
-        the_text[k + 1] = valid_ascii(0xff);
-        printf("ff ff ");
-      }
-    }
+  {
+    MappedFile file(from);
 
-    the_text[LINE_LENGTH] = '\0';
-    printf(" |%s|\n", the_text);
+    to_text = file.is_open() && is_data_image(file.bytes(), file.size());
+  }
+  if (!machine->load_data(from)) {
+    fprintf(stderr, "cannot load %s\n", from);
+    if (machine->load_error[0]) fprintf(stderr, "%s\n", machine->load_error);
+    return 1;
   }
+  unique_ptr<uint8_t[][WORD_SIZE]> words(
+      new uint8_t[machine->data_words][WORD_SIZE]);
+
+  machine->data.read(0, machine->data_words, words.get());
+  if (to_text) {
+    rc = write_data_text(to, words.get(), machine->data_words);
+  } else {
+    rc = write_data_image(to, words.get(), machine->data_words);
+  }
+  if (!rc) {
+    fprintf(stderr, "cannot write %s\n", to);
+    return 1;
+  }
+  return 0;
 }
 
-void print_memory() {
-  print_formatted_data(reinterpret_cast<unsigned char *>(data), sizeof data);
+/**
+ * take a last checkpoint and stop on SIGTERM or SIGINT, which is what a batch
+ * scheduler sends a job it preempts
+ */
+static void preempt_checkpoint(int) {
+  CheckpointControl *checkpoint = g_checkpoint;
+
+  if (checkpoint) checkpoint->preempt();
 }
 
-// converts the passed string into binary form and inserts it into our data
-// area assumes an even number of words!!!
-void insert_data(string line) {
-  static int data_index = 0;
-  unsigned int i;
-  char ascii_data[5];
-  unsigned char byte1;
-  unsigned char byte2;
-
-  ascii_data[4] = '\0';
-
-  for (i = 0; i < line.length(); i += 4) {
-    ascii_data[0] = line[i];
-    ascii_data[1] = line[i + 1];
-    ascii_data[2] = line[i + 2];
-    ascii_data[3] = line[i + 3];
-    if (data_index < DATA_SIZE * WORD_SIZE) {
-      sscanf(ascii_data, "%02hhx%02hhx", &byte1, &byte2);
-      data[data_index][0] = byte1;
-      data[data_index++][1] = byte2;
+/**
+ * run one program, or carry on with one from a checkpoint, writing
+ * checkpoints as it goes if asked to
+ * @param m the machine to run it on
+ * @param job what to run, its output and errors are filled in
+ * @return the exit status, EXIT_PREEMPTED if the run was stopped by a signal
+ *         and its last checkpoint has everything to carry on
+ */
+template <class M>
+int run_checkpointed(M &m, Job &job, const RunOptions &options,
+                     const Checkpointing &checkpointing) {
+  Checkpointer<M> checkpointer;
+  vector<string> labels;
+  size_t append_at = 0;
+  Phase current_phase;
+
+  // the labels are kept in the checkpoint, the code file may not be around
+  // where the run is restored
+  if (checkpointing.restore_filename) {
+    if (!restore_checkpoint(m, checkpointing.restore_filename, labels,
+                            append_at)) {
+      fprintf(stderr, "cannot restore %s\n", checkpointing.restore_filename);
+      if (m.load_error[0]) fprintf(stderr, "%s\n", m.load_error);
+      return 1;
+    }
+  } else if (!prepare_job<M>(m, job, nullptr)) {
+    write_job(job, false);
+    return 1;
+  } else {
+    read_symbols(job.code_filename, M::CODE_WORDS, labels);
+  }
+  if (!checkpointing.filename) {
+    current_phase = m.run(options);
+  } else {
+    // carrying on in the file restored from, or starting a new one
+    if (!checkpointing.restore_filename ||
+        strcmp(checkpointing.filename, checkpointing.restore_filename) != 0) {
+      append_at = 0;
+    }
+    if (!checkpointer.open(checkpointing.filename, m, labels,
+                           checkpointing.period, append_at)) {
+      fprintf(stderr, "cannot write %s\n", checkpointing.filename);
+      return 1;
+    }
+    g_checkpoint = &checkpointer;
+    signal(SIGTERM, preempt_checkpoint);
+    signal(SIGINT, preempt_checkpoint);
+    current_phase = checkpointer.run(m, options);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    g_checkpoint = nullptr;
+    if (!checkpointer.close()) {
+      fprintf(stderr, "cannot write %s\n", checkpointing.filename);
+      return 1;
+    }
+    if (current_phase == PAUSED) {
+      fprintf(stderr, "stopped, carry on with --restore %s\n",
+              checkpointing.filename);
+      return EXIT_PREEMPTED;
     }
   }
+  if (options.engine == THREADED_ENGINE && options.fusion_report) {
+    m.print_fusion_report(job.errors);
+  }
+  report_job(m, current_phase, job, options, &labels);
+  return write_job(job, false) ? 0 : 1;
 }
 
-// reads in the file data and returns true is our code and data areas are
-// ready for processing
-bool load_files(const char *code_filename, const char *data_filename) {
-  FILE *code_file = NULL;
-  std::ifstream data_file(data_filename);
-  string line;  // used to read in a line of text
-  bool rc = false;
-
-  // using RAW C here since I want to have straight binary access to the data
-  code_file = fopen(code_filename, "r");
-
-  // since we're allowing anything to be specified, make sure it's a file...
-  if (code_file) {
-    // put the code into the code area
-    fread(code, 1, CODE_SIZE * WORD_SIZE, code_file);
-
-    fclose(code_file);
-
-    // since we're allowing anything to be specified, make sure it's a file...
-    if (data_file.is_open()) {
-      // read the data into our data area
-      getline(data_file, line);
-      while (!data_file.eof()) {
-        // put the data into the data area
-        insert_data(line);
-
-        getline(data_file, line);
-      }
-      data_file.close();
+/**
+ * run the program, batch or fork run the command line asked for on machines
+ * of type M
+ * @param manifest_filename the batch to run, or NULL
+ * @param patches_filename the patches to fork the program with, or NULL
+ * @param trace_filename where to trace the program to, or NULL
+ * @param checkpointing checkpoints to write or restore from, for a single run
+ * @return the exit status
+ */
+template <class M>
+int simulate(const RunOptions &options, const char *code_filename,
+             const char *data_filename, const char *manifest_filename,
+             const char *patches_filename, const char *trace_filename,
+             const Checkpointing &checkpointing, unsigned workers) {
+  if (manifest_filename) {
+    vector<Job> jobs;
+
+    if (!read_manifest(manifest_filename, jobs)) return 1;
+    return run_batch<M>(jobs, options, workers, nullptr);
+  }
+
+  unique_ptr<M> machine(new M);
 
-      // both files were read so we can continue processing
-      rc = true;
+  if (patches_filename) {
+    vector<Job> jobs;
+
+    // load and decode the base image once, every job starts from a copy
+    if (!machine->load(code_filename, data_filename)) {
+      fprintf(stderr, "cannot load %s and %s\n", code_filename, data_filename);
+      if (machine->load_error[0]) fprintf(stderr, "%s\n", machine->load_error);
+      return 1;
+    }
+    machine->reset_loop_detection();
+    if (!read_patches(patches_filename, code_filename, data_filename,
+                      M::DATA_WORDS, jobs)) {
+      return 1;
     }
+    return run_batch(jobs, options, workers, machine.get());
   }
 
+  Job job;
+  unique_ptr<TraceWriter> trace;
+  int rc;
+
+  // the writer has a big ring buffer, only a traced run gets one
+  if (trace_filename) {
+    trace.reset(new TraceWriter);
+    if (!trace->open(trace_filename)) {
+      fprintf(stderr, "cannot write %s\n", trace_filename);
+      return 1;
+    }
+    machine->trace = trace.get();
+  }
+  // a restored program has no files of its own, the checkpoint stands in
+  job.code_filename =
+      code_filename ? code_filename : checkpointing.restore_filename;
+  job.data_filename =
+      data_filename ? data_filename : checkpointing.restore_filename;
+  if (checkpointing.filename || checkpointing.restore_filename) {
+    rc = run_checkpointed(*machine, job, options, checkpointing);
+  } else {
+    run_job<M>(*machine, job, options, nullptr);
+    write_job(job, false);
+    rc = 0;
+  }
+  if (trace && !trace->close()) {
+    fprintf(stderr, "cannot write %s\n", trace_filename);
+    return 1;
+  }
   return rc;
 }
 
 // runs our simulation after initializing our memory
 int main(int argc, const char *argv[]) {
-  Phase current_phase = FETCH_INSTR;  // we always start if an instruction fetch
-
-  initialize_system();
-
-  // read in our code and data
-  if (load_files(argv[1], argv[2])) {
-    // run our simulator
-    while (current_phase < NUM_PHASES)
-      current_phase = control_unit[current_phase]();
-
-    // output what stopped the simulator
-    switch (current_phase) {
-      case ILLEGAL_OPCODE:
-        printf("Illegal instruction %02x%02x detected at address %04x\n\n",
-               /*better put some data here!*/ g_current_inst_raw[0],
-               g_current_inst_raw[1], register_pc);
-        break;
-
-      case INFINITE_LOOP:
-        printf(
-            "Possible infinite loop detected with instruction %02x%02x at "
-            "address %04x\n\n",
-            /*better put some data here!*/ g_current_inst_raw[0],
-            g_current_inst_raw[1], register_pc);
-        break;
-
-      case ILLEGAL_ADDRESS:
-        printf(
-            "Illegal address %04x detected with instruction %02x%02x at "
-            "address %04x\n\n",
-            /*better put some data here!*/ register_pc, g_current_inst_raw[0],
-            g_current_inst_raw[1], register_pc);
-        break;
-
-      default:
-        break;
+  RunOptions options = {PHASE_ENGINE, true, false, false, HEX_DUMP};
+  const char *code_filename = NULL;
+  const char *data_filename = NULL;
+  const char *manifest_filename = NULL;
+  const char *patches_filename = NULL;
+  const char *trace_filename = NULL;
+  const char *convert_from = NULL;
+  const char *convert_to = NULL;
+  Checkpointing checkpointing = {NULL, CHECKPOINT_PERIOD, NULL};
+  unsigned workers = 0;
+  bool large = false;
+
+  // options can go anywhere, everything else is a file name
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-fusion") == 0) {
+      options.fusion = false;
+    } else if (strcmp(argv[i], "--fusion-report") == 0) {
+      options.fusion_report = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      options.profile = true;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      options.engine = NUM_ENGINES;
+      for (int e = 0; e < NUM_ENGINES; e++) {
+        if (strcmp(argv[i + 1], ENGINES_STR[e]) == 0) {
+          options.engine = (Engine)e;
+        }
+      }
+      i++;
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      options.dump = NUM_DUMP_FORMATS;
+      for (int f = 0; f < NUM_DUMP_FORMATS; f++) {
+        if (strcmp(argv[i + 1], DUMP_FORMATS_STR[f]) == 0) {
+          options.dump = (DumpFormat)f;
+        }
+      }
+      i++;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      manifest_filename = argv[++i];
+    } else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+      convert_from = argv[++i];
+      convert_to = argv[++i];
+    } else if (strcmp(argv[i], "--large") == 0) {
+      large = true;
+    } else if (strcmp(argv[i], "--fork") == 0 && i + 1 < argc) {
+      patches_filename = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_filename = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpointing.filename = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      checkpointing.period = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      checkpointing.restore_filename = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      workers = strtoul(argv[++i], NULL, 10);
+    } else if (!code_filename) {
+      code_filename = argv[i];
+    } else if (!data_filename) {
+      data_filename = argv[i];
     }
+  }
+  if (convert_from) {
+    return large ? convert_data<LargeMachine>(convert_from, convert_to)
+                 : convert_data<Machine>(convert_from, convert_to);
+  }
+  if ((manifest_filename ? code_filename != NULL || patches_filename
+        : checkpointing.restore_filename
+            ? code_filename != NULL || patches_filename
+            : !code_filename || !data_filename) ||
+      options.engine == NUM_ENGINES || options.dump == NUM_DUMP_FORMATS ||
+      (trace_filename && (manifest_filename || patches_filename ||
+                          options.engine != PHASE_ENGINE)) ||
+      ((checkpointing.filename || checkpointing.restore_filename) &&
+       (manifest_filename || patches_filename ||
+        options.engine == LOCKSTEP_ENGINE || !(checkpointing.period > 0)))) {
+    printf(
+        "usage: %s [--engine phase|threaded|jit|lockstep] [--no-fusion] "
+        "[--fusion-report] [--profile]\n"
+        "          [--dump hex|raw|diff|sparse] [--large] <code.o> "
+        "<memory.dat>\n"
+        "       (a <code.asm> is assembled first, - reads it from stdin;\n"
+        "        --large gives 64K words of code and of data)\n"
+        "       %s [--engine phase] --trace <trace> <code.o> <memory.dat>\n"
+        "       %s [options] --checkpoint <file> [--checkpoint-every seconds] "
+        "<code.o> <memory.dat>\n"
+        "       %s [options] [--checkpoint <file>] --restore <file>\n"
+        "       (exits with 3 after a checkpoint on SIGTERM or SIGINT, the\n"
+        "        default is a checkpoint every %d seconds)\n"
+        "       %s [options] [--threads n] --batch <manifest>\n"
+        "       %s [options] [--threads n] --fork <patches> <code.o> "
+        "<memory.dat>\n"
+        "       %s [--large] --convert <from.dat> <to.dat>\n",
+        argv[0], argv[0], argv[0], argv[0], CHECKPOINT_PERIOD, argv[0],
+        argv[0], argv[0]);
+    return 1;
+  }
 
-    // print out the data area
-    print_memory();
+  if (large) {
+    return simulate<LargeMachine>(options, code_filename, data_filename,
+                                  manifest_filename, patches_filename,
+                                  trace_filename, checkpointing, workers);
   }
+  return simulate<Machine>(options, code_filename, data_filename,
+                           manifest_filename, patches_filename,
+                           trace_filename, checkpointing, workers);
 }
@@ -0,0 +1,87 @@
+// A work-stealing thread pool for running many independent jobs. The jobs are
+// dealt out to the workers up front; each worker takes its own jobs from the
+// front of its queue and, once that is empty, steals from the back of the
+// other queues, so a few long jobs don't leave the rest of the pool idle.
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+ public:
+  /**
+   * @param workers number of threads, 0 for one per hardware thread
+   */
+  explicit ThreadPool(unsigned workers) : workers_(workers) {
+    if (workers_ == 0) workers_ = std::thread::hardware_concurrency();
+    if (workers_ == 0) workers_ = 1;
+  }
+
+  unsigned workers() const { return workers_; }
+
+  /**
+   * run jobs 0 to count - 1 and wait for all of them to finish
+   * @param count number of jobs
+   * @param job called as job(worker, index), worker is the number of the
+   *            thread running it so the caller can keep per-thread state
+   */
+  void run(size_t count, const std::function<void(unsigned, size_t)> &job) {
+    std::vector<Queue> queues(workers_);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < count; i++) {
+      queues[i % workers_].jobs.push_back(i);
+    }
+    for (unsigned w = 1; w < workers_; w++) {
+      threads.emplace_back([&, w] { work(queues, w, job); });
+    }
+    work(queues, 0, job);
+    for (auto &thread : threads) thread.join();
+  }
+
+ private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+  };
+
+  unsigned workers_;
+
+  // run jobs until every queue is empty
+  void work(std::vector<Queue> &queues, unsigned worker,
+            const std::function<void(unsigned, size_t)> &job) {
+    size_t index;
+
+    while (take(queues[worker], true, index) || steal(queues, worker, index)) {
+      job(worker, index);
+    }
+  }
+
+  bool steal(std::vector<Queue> &queues, unsigned worker, size_t &index) {
+    for (unsigned i = 1; i < workers_; i++) {
+      if (take(queues[(worker + i) % workers_], false, index)) return true;
+    }
+    return false;
+  }
+
+  static bool take(Queue &queue, bool front, size_t &index) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    if (queue.jobs.empty()) return false;
+    if (front) {
+      index = queue.jobs.front();
+      queue.jobs.pop_front();
+    } else {
+      index = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+    return true;
+  }
+};
+
+#endif  // THREAD_POOL_H_
@@ -0,0 +1,77 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "machine.h"
+
+bool TraceWriter::open(const char *filename) {
+  TraceHeader header = {};
+
+  close();
+  file_ = fopen(filename, "wb");
+  if (!file_) return false;
+  memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  failed_ = fwrite(&header, sizeof header, 1, file_) != 1;
+  head_ = 0;
+  tail_ = 0;
+  stop_ = false;
+  writer_ = std::thread(&TraceWriter::drain, this);
+  return true;
+}
+
+bool TraceWriter::close() {
+  bool rc;
+
+  if (!file_) return true;
+  stop_.store(true, std::memory_order_release);
+  writer_.join();
+  rc = fclose(file_) == 0 && !failed_;
+  file_ = nullptr;
+  return rc;
+}
+
+void TraceWriter::drain() {
+  for (;;) {
+    // read stop_ first, so the records added before it was set are seen
+    bool stopping = stop_.load(std::memory_order_acquire);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+
+    if (head == tail) {
+      if (stopping) return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    // the waiting records, up to the end of the ring
+    uint32_t start = tail & (TRACE_RING_SIZE - 1);
+    uint32_t count = head - tail;
+
+    if (count > TRACE_RING_SIZE - start) count = TRACE_RING_SIZE - start;
+    if (fwrite(&ring_[start], sizeof(TraceRecord), count, file_) != count) {
+      failed_ = true;
+    }
+    tail_.store(tail + count, std::memory_order_release);
+  }
+}
+
+void format_trace_record(const TraceRecord &record, bool changes,
+                         std::string &out) {
+  char line[64];
+
+  snprintf(line, sizeof line, "#%u\tPC: %u\tINST: ", record.counter,
+           record.pc);
+  out += line;
+  format_instruction(record.instruction, out);
+  if (changes && record.change == TRACE_REGISTER) {
+    snprintf(line, sizeof line, "\tR%u = %04x", record.where, record.value);
+    out += line;
+  } else if (changes && record.change == TRACE_MEMORY) {
+    snprintf(line, sizeof line, "\t[%04x] = %04x", record.where,
+             record.value);
+    out += line;
+  }
+  out += '\n';
+}
@@ -0,0 +1,114 @@
+// Execution traces. While tracing, the phase engine appends one fixed size
+// record per instruction to a ring buffer, and a background thread writes
+// the buffer out to the trace file, so the simulation itself never formats
+// text or waits on the disk. trace_decode turns a trace file back into text.
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+// the first bytes of every trace file
+#define TRACE_MAGIC "S5TR"
+#define TRACE_MAGIC_SIZE 4
+#define TRACE_VERSION 1
+// records in the ring buffer, a power of two
+#define TRACE_RING_SIZE (1 << 16)
+
+// what an instruction changed
+enum TRACE_CHANGES {
+  TRACE_NOTHING,   // a branch
+  TRACE_REGISTER,  // a general register
+  TRACE_MEMORY,    // a data word
+};
+
+// The trace file header, all single bytes like the image header.
+struct TRACE_HEADER {
+  char magic[TRACE_MAGIC_SIZE];  // TRACE_MAGIC
+  uint8_t version;               // TRACE_VERSION
+  uint8_t record_size;           // sizeof(TraceRecord)
+  uint8_t reserved[2];           // 0
+};
+
+typedef struct TRACE_HEADER TraceHeader;
+
+// One instruction that ran, in host byte order. A run on the classic machine
+// can't go past CODE_SIZE * INFINITE_LOOP_TRIGGER_THRESHOLD instructions, so
+// the counter fits in 32 bits; a large machine's wraps past 4G records.
+struct TRACE_RECORD {
+  uint32_t counter;        // instructions before this one
+  uint16_t pc;             // where it was
+  uint8_t instruction[2];  // the raw word, big endian as in the code area
+  uint8_t change;          // a TRACE_CHANGES
+  uint8_t reserved;        // 0
+  uint16_t where;          // the register number or data address changed
+  uint16_t value;          // what it holds now
+  uint16_t padding;        // 0
+};
+
+typedef struct TRACE_RECORD TraceRecord;
+
+class TraceWriter {
+ public:
+  TraceWriter()
+      : file_(nullptr), failed_(false), head_(0), tail_(0), stop_(false) {}
+  ~TraceWriter() { close(); }
+
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+
+  /**
+   * create the trace file and start the thread that writes it
+   * @return false if the file can't be created
+   */
+  bool open(const char *filename);
+
+  /**
+   * write out whatever is left in the ring and close the file
+   * @return false if any write failed
+   */
+  bool close();
+
+  /**
+   * add a record. Only one thread may add records; it waits for the writer
+   * if the ring is full, so nothing is lost.
+   */
+  void record(const TraceRecord &record) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+
+    while (head - tail_.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+      std::this_thread::yield();
+    }
+    ring_[head & (TRACE_RING_SIZE - 1)] = record;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+ private:
+  FILE *file_;
+  bool failed_;
+  std::thread writer_;
+  // records [tail_, head_) are waiting to be written, both only ever grow
+  // (modulo 2^32); head_ belongs to the tracing thread, tail_ to the writer
+  std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> tail_;
+  std::atomic<bool> stop_;
+  TraceRecord ring_[TRACE_RING_SIZE];
+
+  // the writer thread, drains the ring until told to stop
+  void drain();
+};
+
+/**
+ * append the text form of a record, one line in the format of the old
+ * print_inst() debug output
+ * @param record the record
+ * @param changes also show what the instruction changed
+ * @param out where the text goes
+ */
+void format_trace_record(const TraceRecord &record, bool changes,
+                         std::string &out);
+
+#endif  // TRACE_H_
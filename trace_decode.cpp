@@ -0,0 +1,70 @@
+// Turns a trace written by the simulator's --trace into text, one line per
+// instruction.
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "dump.h"
+#include "mapped_file.h"
+#include "trace.h"
+
+using namespace std;
+
+// records formatted before the text is written out
+#define DECODE_BATCH 4096
+
+int main(int argc, const char *argv[]) {
+  const char *trace_filename = NULL;
+  bool changes = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--changes") == 0) {
+      changes = true;
+    } else if (!trace_filename) {
+      trace_filename = argv[i];
+    }
+  }
+  if (!trace_filename) {
+    printf("usage: %s [--changes] <trace>\n", argv[0]);
+    return 1;
+  }
+
+  MappedFile trace(trace_filename);
+  TraceHeader header;
+  TraceRecord record;
+  string text;
+
+  if (!trace.is_open()) {
+    fprintf(stderr, "cannot open %s\n", trace_filename);
+    return 1;
+  }
+  if (trace.size() < sizeof header) {
+    fprintf(stderr, "%s is not a trace\n", trace_filename);
+    return 1;
+  }
+  memcpy(&header, trace.bytes(), sizeof header);
+  if (memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof record) {
+    fprintf(stderr, "%s is not a trace this version can read\n",
+            trace_filename);
+    return 1;
+  }
+
+  size_t records = (trace.size() - sizeof header) / sizeof record;
+
+  for (size_t i = 0; i < records; i++) {
+    memcpy(&record, trace.bytes() + sizeof header + i * sizeof record,
+           sizeof record);
+    format_trace_record(record, changes, text);
+    if (i % DECODE_BATCH == DECODE_BATCH - 1 || i == records - 1) {
+      if (!write_all(1, text.data(), text.size())) return 1;
+      text.clear();
+    }
+  }
+  if (trace.size() - sizeof header != records * sizeof record) {
+    fprintf(stderr, "%s ends in the middle of a record\n", trace_filename);
+    return 1;
+  }
+  return 0;
+}